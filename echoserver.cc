@@ -2,9 +2,11 @@
 #include <iostream>
 #include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #include <vector>
 
@@ -23,9 +25,17 @@ const char* SHUT_DOWN 		= "-ERR Server shutting down\r\n";
 vector< pthread_t > THREADS;
 vector< int > SOCKETS;
 bool DEBUG = false;
+int ACCEPTORS = 1;
+int BACKLOG = 100;
+bool PIN_CPUS = false;
+vector< int > LISTENERS;
+pthread_mutex_t REGISTRY_LOCK = PTHREAD_MUTEX_INITIALIZER;
 
 // function signatures
 void signal_handler(int arg);
+int open_listener(unsigned short port);
+void accept_loop(int index);
+void* acceptor(void* arg);
 void* worker(void* arg);
 void removeCommand(char* buf, char* end);
 
@@ -39,7 +49,7 @@ int main(int argc, char *argv[]) {
 	// port defaults to 10000 if no arguments given
 	unsigned short port = 10000;
 
-	while ((option = getopt(argc, argv, "p:av")) != -1) {
+	while ((option = getopt(argc, argv, "p:avl:b:c")) != -1) {
 		switch(option) {
 		case 'p':
 			port = atoi(optarg);
@@ -53,12 +63,45 @@ int main(int argc, char *argv[]) {
 			DEBUG = true;
 			break;
 
+		case 'l':
+			ACCEPTORS = atoi(optarg) > 0 ? atoi(optarg) : 1;
+			break;
+
+		case 'b':
+			BACKLOG = atoi(optarg);
+			break;
+
+		case 'c':
+			PIN_CPUS = true;
+			break;
+
 		default:
-			cerr << "Usage: " << argv[0] << " [-p port_number] [-a] [-v]\r\n";
+			cerr << "Usage: " << argv[0] << " [-p port_number] [-a] [-v] [-l acceptors] [-b backlog] [-c]\r\n";
 			exit(1);
 		}
 	}
 
+	// one listening socket per acceptor. With more than one, SO_REUSEPORT lets the kernel spread incoming
+	// connections across them.
+	for (int i = 0; i < ACCEPTORS; i++) {
+		LISTENERS.push_back(open_listener(port));
+	}
+
+	for (int i = 1; i < ACCEPTORS; i++) {
+		pthread_t thread;
+		pthread_create(&thread, NULL, &acceptor, (void*)(intptr_t)i);
+		pthread_mutex_lock(&REGISTRY_LOCK);
+		THREADS.push_back(thread);
+		pthread_mutex_unlock(&REGISTRY_LOCK);
+	}
+	accept_loop(0);
+
+	return 0;
+}
+
+// Opens a listening socket on the given port. Exits if the socket cannot be set up.
+// port:	port number to listen on
+int open_listener(unsigned short port) {
 	// connect to socket
 	int listen_fd = socket(PF_INET, SOCK_STREAM, 0);
 	if (listen_fd < 0) {
@@ -68,9 +111,12 @@ int main(int argc, char *argv[]) {
 
 	SOCKETS.push_back(listen_fd);
 	
-	// set port as reusable
+	// set port as reusable, and shareable between acceptors
 	const int enable = 1;
 	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
+	if (ACCEPTORS > 1) {
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int));
+	}
 
 	// set up server
 	struct sockaddr_in servaddr;
@@ -79,8 +125,28 @@ int main(int argc, char *argv[]) {
 	servaddr.sin_addr.s_addr = htons(INADDR_ANY);
 	servaddr.sin_port = htons(port);
 
-	bind(listen_fd, (struct sockaddr*)&servaddr, sizeof(servaddr));
-	listen(listen_fd, 100);
+	if (bind(listen_fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
+		cerr << "Error binding socket\r\n";
+		exit(1);
+	}
+	listen(listen_fd, BACKLOG);
+
+	return listen_fd;
+}
+
+// Accepts connections on one listening socket and dispatches them. The first listener is served by main, the
+// others by acceptor threads.
+// index:	index of the listening socket in LISTENERS
+void accept_loop(int index) {
+	int listen_fd = LISTENERS[index];
+
+	// optionally pin each acceptor to its own core
+	if (PIN_CPUS) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(index % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
 
 	while (true) {
 		// set up client connection
@@ -91,19 +157,28 @@ int main(int argc, char *argv[]) {
 		if (fd == -1) {
 			break;
 		}
+		pthread_mutex_lock(&REGISTRY_LOCK);
 		SOCKETS.push_back(fd);
+		pthread_mutex_unlock(&REGISTRY_LOCK);
 
 		if (DEBUG) {
 			cerr << "[" << fd << "] " << NEW_CONN;
 		}
 
 		pthread_t thread;
-		THREADS.push_back(thread);
 		// dispatch worker thread to handle client communication
-		pthread_create(&thread, NULL, &worker, &fd);
+		pthread_create(&thread, NULL, &worker, new int(fd));
+		pthread_mutex_lock(&REGISTRY_LOCK);
+		THREADS.push_back(thread);
+		pthread_mutex_unlock(&REGISTRY_LOCK);
 	}
+}
 
-	return 0;
+// Acceptor thread for an additional listening socket.
+// arg: index of the listening socket in LISTENERS
+void* acceptor(void* arg) {
+	accept_loop((intptr_t)arg);
+	pthread_exit(NULL);
 }
 
 // Handler of SIGINT. Once SIGINT is received, this function writes a message to clients, closes their 
@@ -115,14 +190,18 @@ void signal_handler(int arg) {
 	for (int i = 1; i < SOCKETS.size(); i++) {
 		write(SOCKETS[i], SHUT_DOWN, strlen(SHUT_DOWN));
 		close(SOCKETS[i]);
-		pthread_kill(THREADS[i - 1], 0);
+	}
+
+	for (int i = 0; i < THREADS.size(); i++) {
+		pthread_kill(THREADS[i], 0);
 	}
 }
 
 // Worker thread that handles the connection. One thread for one client.
-// arg: file descriptor of the socket the client connects to.
+// arg: heap-allocated file descriptor of the socket the client connects to.
 void* worker(void* arg) {
 	int comm_fd = *(int*)arg;
+	delete (int*)arg;
 	write(comm_fd, GREETING, strlen(GREETING));
 
 	// buffer for client's command
@@ -0,0 +1,265 @@
+#ifndef IORING_H
+#define IORING_H
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// io_uring driven through the raw system calls, without liburing. A ring belongs to one thread: it fills
+// submission entries in shared memory, hands all of them to the kernel in the same io_uring_enter() that waits
+// for completions, and reaps the completions from shared memory without any further system call.
+//
+// Receives can pick their buffers from a ring of provided buffers registered with the kernel
+// (IORING_REGISTER_PBUF_RING). A multishot recv on such a ring keeps reporting data for as long as the
+// connection is open, without a new submission per read, and an idle connection holds no buffer at all.
+// start() fails on kernels without io_uring, and provide_buffers() on kernels without buffer rings; the caller
+// falls back to epoll, or to single-shot receives into its own buffers.
+
+class IoRing {
+public:
+	IoRing(): ring_fd(-1), rings(NULL), rings_len(0), sqes(NULL), sqes_len(0), sq_entries(0), sq_tail_local(0),
+		sq_submitted(0), buffers(NULL), buffer_ring(NULL), buffer_count(0), buffer_size(0), buffer_group(0) {
+		memset(supported, 0, sizeof(supported));
+	}
+	~IoRing() { stop(); }
+
+	// Sets up a ring with room for entries submissions and four times as many completions. Returns false if
+	// the kernel has no io_uring.
+	// entries:	submission queue size, a power of 2
+	bool start(unsigned entries) {
+		struct io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		// the kernel completes operations only when the ring's thread waits in io_uring_enter(), rather than
+		// interrupting it at every system call
+		params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER
+			| IORING_SETUP_DEFER_TASKRUN;
+		params.cq_entries = entries * 4;
+		ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+		if (ring_fd < 0 && errno == EINVAL) {
+			// kernels before 6.1 know fewer setup flags
+			memset(&params, 0, sizeof(params));
+			params.flags = IORING_SETUP_CQSIZE;
+			params.cq_entries = entries * 4;
+			ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+		}
+		if (ring_fd < 0) {
+			return false;
+		}
+		if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+			stop();
+			return false;
+		}
+
+		size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		size_t cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+		rings_len = sq_len > cq_len ? sq_len : cq_len;
+		rings = (char*)mmap(NULL, rings_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+			IORING_OFF_SQ_RING);
+		sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+		sqes = (struct io_uring_sqe*)mmap(NULL, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring_fd, IORING_OFF_SQES);
+		if (rings == MAP_FAILED || sqes == MAP_FAILED) {
+			rings = rings == MAP_FAILED ? NULL : rings;
+			sqes = sqes == MAP_FAILED ? NULL : sqes;
+			stop();
+			return false;
+		}
+
+		sq_head = (unsigned*)(rings + params.sq_off.head);
+		sq_tail = (unsigned*)(rings + params.sq_off.tail);
+		sq_mask = *(unsigned*)(rings + params.sq_off.ring_mask);
+		sq_entries = params.sq_entries;
+		cq_head = (unsigned*)(rings + params.cq_off.head);
+		cq_tail = (unsigned*)(rings + params.cq_off.tail);
+		cq_mask = *(unsigned*)(rings + params.cq_off.ring_mask);
+		cqes = (struct io_uring_cqe*)(rings + params.cq_off.cqes);
+
+		// submission entries are used in order, so the indirection array stays the identity
+		unsigned* array = (unsigned*)(rings + params.sq_off.array);
+		for (unsigned i = 0; i < sq_entries; i++) {
+			array[i] = i;
+		}
+
+		size_t probe_len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+		struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, probe_len);
+		if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+			for (int i = 0; i < probe->ops_len && i < 256; i++) {
+				supported[probe->ops[i].op] = (probe->ops[i].flags & IO_URING_OP_SUPPORTED) != 0;
+			}
+		}
+		free(probe);
+		return true;
+	}
+
+	// Tears the ring down. Operations still in flight are cancelled by the kernel.
+	void stop() {
+		if (buffer_ring != NULL) {
+			munmap(buffer_ring, buffer_count * sizeof(struct io_uring_buf));
+			buffer_ring = NULL;
+		}
+		free(buffers);
+		buffers = NULL;
+		if (sqes != NULL) {
+			munmap(sqes, sqes_len);
+			sqes = NULL;
+		}
+		if (rings != NULL) {
+			munmap(rings, rings_len);
+			rings = NULL;
+		}
+		if (ring_fd >= 0) {
+			close(ring_fd);
+			ring_fd = -1;
+		}
+	}
+
+	// Returns true if the kernel knows an operation.
+	// opcode:	IORING_OP_*
+	bool supports(int opcode) {
+		return opcode >= 0 && opcode < 256 && supported[opcode];
+	}
+
+	// Returns a cleared submission entry. Entries go to the kernel with the next submit(); if the queue is
+	// full, the queued entries are submitted first.
+	struct io_uring_sqe* sqe() {
+		if (sq_tail_local - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+			submit(0);
+		}
+		struct io_uring_sqe* entry = &sqes[sq_tail_local & sq_mask];
+		memset(entry, 0, sizeof(*entry));
+		sq_tail_local++;
+		return entry;
+	}
+
+	// Submits the queued entries and waits until at least wait completions are ready, in one system call.
+	// Returns false if the ring failed; an interrupted wait returns true.
+	// wait:	completions to wait for, 0 to only submit
+	bool submit(unsigned wait) {
+		__atomic_store_n(sq_tail, sq_tail_local, __ATOMIC_RELEASE);
+		unsigned queued = sq_tail_local - sq_submitted;
+		if (queued == 0 && wait == 0) {
+			return true;
+		}
+
+		int ret = syscall(__NR_io_uring_enter, ring_fd, queued, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0,
+			NULL, 0);
+		if (ret < 0) {
+			return errno == EINTR || errno == EAGAIN || errno == EBUSY;
+		}
+		sq_submitted += ret;
+		return true;
+	}
+
+	// Returns the oldest completion not yet consumed, or NULL if there is none.
+	struct io_uring_cqe* completion() {
+		unsigned head = *cq_head;
+		if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+			return NULL;
+		}
+		return &cqes[head & cq_mask];
+	}
+
+	// Consumes the completion returned by completion().
+	void consume() {
+		__atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+	}
+
+	// Registers a ring of count provided buffers of size bytes each. Returns false if the kernel has no buffer
+	// rings.
+	// group:	buffer group id that receives select from
+	// count:	number of buffers, a power of 2
+	// size:	bytes per buffer
+	bool provide_buffers(int group, unsigned count, unsigned size) {
+		size_t ring_len = count * sizeof(struct io_uring_buf);
+		void* ring = mmap(NULL, ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ring == MAP_FAILED) {
+			return false;
+		}
+
+		struct io_uring_buf_reg reg;
+		memset(&reg, 0, sizeof(reg));
+		reg.ring_addr = (uint64_t)(uintptr_t)ring;
+		reg.ring_entries = count;
+		reg.bgid = group;
+		if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+			munmap(ring, ring_len);
+			return false;
+		}
+
+		buffer_ring = (struct io_uring_buf_ring*)ring;
+		buffer_count = count;
+		buffer_size = size;
+		buffer_group = group;
+		buffers = (char*)malloc((size_t)count * size);
+		buffer_tail = 0;
+		for (unsigned i = 0; i < count; i++) {
+			recycle(i);
+		}
+		return true;
+	}
+
+	// Returns true once provide_buffers() has succeeded.
+	bool has_buffers() {
+		return buffer_ring != NULL;
+	}
+
+	// Group id of the provided buffers.
+	int group() {
+		return buffer_group;
+	}
+
+	// Returns a provided buffer that a completion reported data in.
+	// id:	buffer id, from the upper bits of the completion's flags
+	char* buffer(unsigned id) {
+		return buffers + (size_t)id * buffer_size;
+	}
+
+	// Gives a provided buffer back to the kernel once its data has been used.
+	// id:	buffer id
+	void recycle(unsigned id) {
+		// indexed by hand: in C++ the empty member in front of the flexible bufs array moves it off offset 0
+		struct io_uring_buf* slot = (struct io_uring_buf*)buffer_ring + (buffer_tail & (buffer_count - 1));
+		slot->addr = (uint64_t)(uintptr_t)buffer(id);
+		slot->len = buffer_size;
+		slot->bid = id;
+		buffer_tail++;
+		__atomic_store_n(&buffer_ring->tail, buffer_tail, __ATOMIC_RELEASE);
+	}
+
+private:
+	IoRing(const IoRing&);
+	IoRing& operator=(const IoRing&);
+
+	int ring_fd;
+	char* rings;
+	size_t rings_len;
+	struct io_uring_sqe* sqes;
+	size_t sqes_len;
+
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	// entries filled in, and entries the kernel has taken
+	unsigned sq_tail_local;
+	unsigned sq_submitted;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe* cqes;
+	bool supported[256];
+
+	char* buffers;
+	struct io_uring_buf_ring* buffer_ring;
+	unsigned buffer_count;
+	unsigned buffer_size;
+	int buffer_group;
+	uint16_t buffer_tail;
+};
+
+#endif
@@ -0,0 +1,355 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sstream>
+#include <string>
+#include <string.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// durability modes
+const int DURABLE_NONE 		= 0;
+const int DURABLE_BATCH 	= 1;
+const int DURABLE_MESSAGE 	= 2;
+
+// constant integers
+const long JOURNAL_LIMIT 	= 4 << 20;
+
+// One accepted message, from its journal record until its mailboxes are synced.
+struct Delivery {
+	long id;
+	int spool_fd;
+	std::string spool_path;
+	std::string sender;
+	std::vector< std::string > rcpts;
+	bool committed;
+	bool durable;
+
+	Delivery(): id(0), spool_fd(-1), committed(false), durable(false) {}
+};
+
+// Write-ahead journal of accepted messages, PARENTDIR/.journal. Before a message is acknowledged, a record
+// naming its spool file, sender and recipients is synced to disk together with the spool file. The message is
+// appended to the mailboxes afterwards; once those are synced the record is marked done and the spool file is
+// removed. A record that is not done at startup is replayed from its spool file.
+//
+// In batch mode a committer thread syncs the records of all messages finished while the previous sync was
+// running with a single fsync of the journal. In message mode every message syncs on its own.
+//
+// Records are text lines: "P <id> <spool file> <sender> <rcpt>..." and "D <id>". The journal is truncated
+// whenever no delivery is in flight, and rewritten with only the open records once it grows past
+// JOURNAL_LIMIT under steady load.
+class DeliveryJournal {
+public:
+	DeliveryJournal(): fd(-1), spool_dir(-1), store_dir(-1), mode(DURABLE_NONE), next_id(1), size(0) {
+		pthread_mutex_init(&lock, NULL);
+		pthread_cond_init(&wake, NULL);
+		pthread_cond_init(&synced, NULL);
+	}
+
+	// Opens the journal, collects the deliveries left unfinished by the last run and removes spool files that
+	// no record refers to. Every unfinished delivery must be replayed and passed to finish(). Returns false if
+	// the journal cannot be opened.
+	// dir:			mailbox directory, with .spool and .store in it
+	// mode:		one of the DURABLE_ modes
+	// unfinished:	set to the deliveries to replay
+	bool start(const char* dir, int mode, std::vector< Delivery* >& unfinished) {
+		this->dir = dir;
+		this->mode = mode;
+		fd = ::open((this->dir + "/.journal").c_str(), O_RDWR | O_CREAT | O_APPEND, 0600);
+		spool_dir = ::open((this->dir + "/.spool").c_str(), O_RDONLY | O_DIRECTORY);
+		store_dir = ::open((this->dir + "/.store").c_str(), O_RDONLY | O_DIRECTORY);
+		if (fd < 0 || spool_dir < 0 || store_dir < 0) {
+			return false;
+		}
+
+		recover(unfinished);
+
+		if (mode == DURABLE_BATCH) {
+			pthread_t thread;
+			pthread_create(&thread, NULL, &committer, this);
+			pthread_detach(thread);
+		}
+		return true;
+	}
+
+	// Writes the record of a message whose body is complete in its spool file. Returns NULL if the record
+	// cannot be written.
+	// spool_fd:	spool file of the message
+	// spool_path:	path of the spool file
+	// sender:		sender of the email
+	// rcpts:		recipients of the email
+	Delivery* begin(int spool_fd, const char* spool_path, const char* sender, std::vector< std::string >& rcpts) {
+		Delivery* delivery = new Delivery();
+		delivery->spool_fd = spool_fd;
+		delivery->spool_path = spool_path;
+		delivery->sender = sender;
+		delivery->rcpts = rcpts;
+
+		const char* name = strrchr(spool_path, '/');
+		pthread_mutex_lock(&lock);
+		delivery->id = next_id++;
+		std::string record = "P " + std::to_string(delivery->id) + " " + (name != NULL ? name + 1 : spool_path)
+			+ " " + sender;
+		for (int i = 0; i < rcpts.size(); i++) {
+			record += " " + rcpts[i];
+		}
+		record += "\n";
+		bool ok = write(fd, record.data(), record.length()) == record.length();
+		if (ok) {
+			records[delivery->id] = record;
+		}
+		size += record.length();
+		pthread_mutex_unlock(&lock);
+
+		if (!ok) {
+			delete delivery;
+			return NULL;
+		}
+		return delivery;
+	}
+
+	// Waits until the record and the spool file of a message are on disk. Returns false if they could not be
+	// synced; the message must then be rejected, but still passed to finish().
+	// delivery:	message returned by begin()
+	bool commit(Delivery* delivery) {
+		if (mode != DURABLE_BATCH) {
+			std::vector< Delivery* > batch(1, delivery);
+			sync(batch);
+			return delivery->durable;
+		}
+
+		pthread_mutex_lock(&lock);
+		to_sync.push_back(delivery);
+		pthread_cond_signal(&wake);
+		while (!delivery->committed) {
+			pthread_cond_wait(&synced, &lock);
+		}
+		pthread_mutex_unlock(&lock);
+		return delivery->durable;
+	}
+
+	// Hands over a message that has been appended to its mailboxes. The journal owns the spool file from here
+	// on and removes it once the mailboxes are synced and the record is marked done.
+	// delivery:	message returned by begin(), or an unfinished one from start()
+	void finish(Delivery* delivery) {
+		if (mode != DURABLE_BATCH) {
+			std::vector< Delivery* > batch(1, delivery);
+			retire(batch);
+			return;
+		}
+
+		pthread_mutex_lock(&lock);
+		to_retire.push_back(delivery);
+		pthread_cond_signal(&wake);
+		pthread_mutex_unlock(&lock);
+	}
+
+private:
+	DeliveryJournal(const DeliveryJournal&);
+	DeliveryJournal& operator=(const DeliveryJournal&);
+
+	// Committer thread of batch mode. Whatever queues up while one batch is being synced forms the next batch.
+	// arg:	the journal
+	static void* committer(void* arg) {
+		DeliveryJournal* journal = (DeliveryJournal*)arg;
+		while (true) {
+			pthread_mutex_lock(&journal->lock);
+			while (journal->to_sync.empty() && journal->to_retire.empty()) {
+				pthread_cond_wait(&journal->wake, &journal->lock);
+			}
+			std::vector< Delivery* > commits;
+			std::vector< Delivery* > finished;
+			commits.swap(journal->to_sync);
+			finished.swap(journal->to_retire);
+			pthread_mutex_unlock(&journal->lock);
+
+			if (!commits.empty()) {
+				journal->sync(commits);
+				pthread_mutex_lock(&journal->lock);
+				for (int i = 0; i < commits.size(); i++) {
+					commits[i]->committed = true;
+				}
+				pthread_cond_broadcast(&journal->synced);
+				pthread_mutex_unlock(&journal->lock);
+			}
+			if (!finished.empty()) {
+				journal->retire(finished);
+			}
+		}
+		return NULL;
+	}
+
+	// Syncs the spool files of a batch, the spool directory and the journal.
+	void sync(std::vector< Delivery* >& batch) {
+		for (int i = 0; i < batch.size(); i++) {
+			batch[i]->durable = fsync(batch[i]->spool_fd) == 0;
+		}
+		bool ok = fsync(spool_dir) == 0 && fdatasync(fd) == 0;
+		for (int i = 0; i < batch.size(); i++) {
+			batch[i]->durable = batch[i]->durable && ok;
+		}
+	}
+
+	// Syncs the mailboxes of a batch of delivered messages, marks their records done and removes their spool
+	// files.
+	void retire(std::vector< Delivery* >& batch) {
+		std::unordered_set< std::string > mailboxes;
+		std::string done;
+		for (int i = 0; i < batch.size(); i++) {
+			for (int j = 0; j < batch[i]->rcpts.size(); j++) {
+				mailboxes.insert(dir + "/" + batch[i]->rcpts[j]);
+			}
+			done += "D " + std::to_string(batch[i]->id) + "\n";
+		}
+
+		for (std::unordered_set< std::string >::iterator it = mailboxes.begin(); it != mailboxes.end(); it++) {
+			int mbox = ::open(it->c_str(), O_RDONLY);
+			if (mbox >= 0) {
+				fsync(mbox);
+				close(mbox);
+			}
+		}
+		fsync(store_dir);
+
+		pthread_mutex_lock(&lock);
+		write(fd, done.data(), done.length());
+		size += done.length();
+		pthread_mutex_unlock(&lock);
+		fdatasync(fd);
+
+		pthread_mutex_lock(&lock);
+		for (int i = 0; i < batch.size(); i++) {
+			if (batch[i]->spool_fd >= 0) {
+				close(batch[i]->spool_fd);
+			}
+			unlink(batch[i]->spool_path.c_str());
+			records.erase(batch[i]->id);
+			delete batch[i];
+		}
+		if (records.empty()) {
+			ftruncate(fd, 0);
+			size = 0;
+		} else if (size > JOURNAL_LIMIT) {
+			rotate();
+		}
+		pthread_mutex_unlock(&lock);
+	}
+
+	// Replaces the journal with a new one that holds only the open records. The new file is swapped in with
+	// dup2(), so a sync running concurrently on the old descriptor stays valid. Called with the lock held.
+	void rotate() {
+		std::string path = dir + "/.journal";
+		std::string next_path = path + ".new";
+		int next = ::open(next_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+		if (next < 0) {
+			return;
+		}
+
+		std::string open_records;
+		for (std::unordered_map< long, std::string >::iterator it = records.begin(); it != records.end(); it++) {
+			open_records += it->second;
+		}
+		bool ok = write(next, open_records.data(), open_records.length()) == open_records.length()
+			&& fsync(next) == 0 && rename(next_path.c_str(), path.c_str()) == 0;
+		if (ok) {
+			int parent = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+			if (parent >= 0) {
+				fsync(parent);
+				close(parent);
+			}
+			dup2(next, fd);
+			size = open_records.length();
+		}
+		close(next);
+	}
+
+	// Reads the journal left by the last run. Spool files of unfinished records are kept for replay; any other
+	// spool file belonged to a message that was never acknowledged.
+	void recover(std::vector< Delivery* >& unfinished) {
+		std::string journal;
+		char buffer[65536];
+		ssize_t rlen;
+		while ((rlen = read(fd, buffer, sizeof(buffer))) > 0) {
+			journal.append(buffer, rlen);
+		}
+
+		std::unordered_map< long, Delivery* > open_records;
+		std::istringstream lines(journal);
+		std::string line;
+		while (std::getline(lines, line)) {
+			std::istringstream fields(line);
+			std::string type;
+			long id;
+			if (!(fields >> type >> id)) {
+				continue;
+			}
+
+			if (type == "P") {
+				Delivery* delivery = new Delivery();
+				std::string name;
+				std::string rcpt;
+				delivery->id = id;
+				fields >> name >> delivery->sender;
+				delivery->spool_path = dir + "/.spool/" + name;
+				while (fields >> rcpt) {
+					delivery->rcpts.push_back(rcpt);
+				}
+				delete open_records[id];
+				open_records[id] = delivery;
+			} else if (type == "D" && open_records.count(id) > 0) {
+				delete open_records[id];
+				open_records.erase(id);
+			}
+		}
+
+		std::unordered_set< std::string > keep;
+		for (std::unordered_map< long, Delivery* >::iterator it = open_records.begin(); it != open_records.end();
+			it++) {
+			Delivery* delivery = it->second;
+			std::string record = "P " + std::to_string(delivery->id) + " "
+				+ delivery->spool_path.substr(dir.length() + 8) + " " + delivery->sender;
+			for (int i = 0; i < delivery->rcpts.size(); i++) {
+				record += " " + delivery->rcpts[i];
+			}
+			records[delivery->id] = record + "\n";
+			next_id = std::max(next_id, delivery->id + 1);
+			unfinished.push_back(it->second);
+			keep.insert(it->second->spool_path);
+		}
+
+		DIR* spool = opendir((dir + "/.spool").c_str());
+		struct dirent* entry;
+		while (spool != NULL && (entry = readdir(spool)) != NULL) {
+			std::string path = dir + "/.spool/" + entry->d_name;
+			if (entry->d_name[0] != '.' && keep.count(path) == 0) {
+				unlink(path.c_str());
+			}
+		}
+		if (spool != NULL) {
+			closedir(spool);
+		}
+	}
+
+	std::string dir;
+	int fd;
+	int spool_dir;
+	int store_dir;
+	int mode;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t synced;
+	std::vector< Delivery* > to_sync;
+	std::vector< Delivery* > to_retire;
+	std::unordered_map< long, std::string > records;
+	long next_id;
+	long size;
+};
+
+#endif
@@ -0,0 +1,255 @@
+#ifndef LINEBUFFER_H
+#define LINEBUFFER_H
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Returns the first occurrence of c in [p, end), or NULL. Scans 32 bytes at a time with AVX2 and 16 bytes at
+// a time with SSE2 when the compiler targets them.
+inline char* find_byte(char* p, char* end, char c) {
+#if defined(__AVX2__)
+	const __m256i needle32 = _mm256_set1_epi8(c);
+	while (end - p >= 32) {
+		unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*)p), needle32));
+		if (mask != 0) {
+			return p + __builtin_ctz(mask);
+		}
+		p += 32;
+	}
+#endif
+#if defined(__SSE2__)
+	const __m128i needle16 = _mm_set1_epi8(c);
+	while (end - p >= 16) {
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)p), needle16));
+		if (mask != 0) {
+			return p + __builtin_ctz(mask);
+		}
+		p += 16;
+	}
+#endif
+	while (p < end) {
+		if (*p == c) {
+			return p;
+		}
+		p++;
+	}
+	return NULL;
+}
+
+// Input buffer of one connection that frames <CR><LF>-terminated lines. The buffer tracks its length instead
+// of relying on '\0', so it is binary safe. Lines are consumed from the head without moving any bytes; only
+// the unfinished tail is moved to the front before the next read. Bytes already scanned are never scanned
+// again, so framing is linear in the input size.
+class LineBuffer {
+public:
+	LineBuffer(int capacity): data((char*)malloc(capacity + 1)), capacity(capacity), head(0), tail(0), scan(0),
+		line_len(0), saved('\0') {}
+	~LineBuffer() { free(data); }
+
+	// Space for the next read(). Moves the unconsumed bytes to the front of the buffer first.
+	// len:	set to the number of bytes that fit
+	char* space(int* len) {
+		if (head > 0 && line_len == 0) {
+			memmove(data, data + head, tail - head);
+			tail -= head;
+			scan -= head;
+			head = 0;
+		}
+		*len = capacity - tail;
+		return data + tail;
+	}
+
+	// Records that len bytes were read into space().
+	void produced(int len) {
+		tail += len;
+	}
+
+	// Returns the next complete line, including its <CR><LF>, or NULL if there is none yet. The line is
+	// '\0'-terminated in place until consume() is called.
+	// len:	set to the length of the line
+	char* next_line(int* len) {
+		char* start = data + head;
+		char* from = data + scan;
+		char* end = data + tail;
+
+		while (from < end) {
+			char* lf = find_byte(from, end, '\n');
+			if (lf == NULL) {
+				break;
+			}
+			if (lf > start && lf[-1] == '\r') {
+				line_len = lf + 1 - start;
+				scan = head + line_len;
+				saved = start[line_len];
+				start[line_len] = '\0';
+				*len = line_len;
+				return start;
+			}
+			from = lf + 1;
+		}
+
+		scan = tail;
+		return NULL;
+	}
+
+	// Drops the line returned by next_line().
+	void consume() {
+		data[head + line_len] = saved;
+		head += line_len;
+		line_len = 0;
+	}
+
+	// Number of buffered bytes that have not been consumed.
+	int size() {
+		return tail - head;
+	}
+
+	// Raw access to the unconsumed bytes, for payloads that are not line oriented.
+	// len:	set to the number of unconsumed bytes
+	char* peek(int* len) {
+		*len = tail - head;
+		return data + head;
+	}
+
+	// Drops len unconsumed bytes returned by peek().
+	void skip(int len) {
+		head += len;
+		if (scan < head) {
+			scan = head;
+		}
+	}
+
+private:
+	LineBuffer(const LineBuffer&);
+	LineBuffer& operator=(const LineBuffer&);
+
+	char* data;
+	int capacity;
+	int head;
+	int tail;
+	int scan;
+	int line_len;
+	char saved;
+};
+
+// Output buffer of one connection. Responses are appended and leave in one send() when the connection has
+// answered all the commands it has read, or whenever the buffer fills, so a multi-line response or a batch of
+// pipelined commands costs a few system calls instead of one per line. Bytes that do not fit go out with the
+// buffered ones and are not copied.
+//
+// On a non-blocking socket, what the kernel does not take stays in the buffer, which grows if it has to, and
+// size() tells the caller to wait until the socket is writable and flush again.
+class OutputBuffer {
+public:
+	OutputBuffer(int fd, int capacity): fd(fd), data((char*)malloc(capacity)), capacity(capacity), len(0),
+		broken(false) {}
+	~OutputBuffer() { free(data); }
+
+	// The socket the buffer writes to, for responses sent around the buffer.
+	int socket() {
+		return fd;
+	}
+
+	// Appends bytes to the buffer. Returns false once the connection is broken.
+	// bytes:	bytes to append
+	// n:		number of bytes
+	bool append(const char* bytes, int n) {
+		if (len + n > capacity) {
+			return send_pending(bytes, n, true);
+		}
+		memcpy(data + len, bytes, n);
+		len += n;
+		return !broken;
+	}
+
+	// Space to format at most n bytes into, e.g. with snprintf(). Flushes first if they may not fit.
+	// n:	number of bytes, at most the capacity
+	char* space(int n) {
+		if (capacity - len < n) {
+			send_pending(NULL, 0, true);
+			reserve(n);
+		}
+		return data + len;
+	}
+
+	// Records that len bytes were formatted into space().
+	void produced(int n) {
+		len += n;
+	}
+
+	// Sends the buffered bytes. Returns false if the connection is broken.
+	// more:	true if more output follows right away, so the kernel may hold a partial segment (MSG_MORE)
+	bool flush(bool more) {
+		return send_pending(NULL, 0, more);
+	}
+
+	// Number of bytes waiting to be sent.
+	int size() {
+		return len;
+	}
+
+private:
+	OutputBuffer(const OutputBuffer&);
+	OutputBuffer& operator=(const OutputBuffer&);
+
+	// Sends the buffered bytes followed by n more, in as few sendmsg() calls as the socket takes.
+	bool send_pending(const char* bytes, int n, bool more) {
+		struct iovec iov[2] = { { data, (size_t)len }, { (void*)bytes, (size_t)n } };
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 2;
+		len = 0;
+
+		while (!broken && (iov[0].iov_len > 0 || iov[1].iov_len > 0)) {
+			ssize_t slen = sendmsg(fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+			if (slen < 0 && errno == EINTR) {
+				continue;
+			}
+			if (slen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				// keep the rest for the next flush
+				memmove(data, iov[0].iov_base, iov[0].iov_len);
+				len = iov[0].iov_len;
+				reserve(iov[1].iov_len);
+				memcpy(data + len, iov[1].iov_base, iov[1].iov_len);
+				len += iov[1].iov_len;
+				break;
+			}
+			if (slen <= 0) {
+				broken = true;
+				break;
+			}
+
+			for (int i = 0; i < 2; i++) {
+				size_t done = (size_t)slen < iov[i].iov_len ? slen : iov[i].iov_len;
+				iov[i].iov_base = (char*)iov[i].iov_base + done;
+				iov[i].iov_len -= done;
+				slen -= done;
+			}
+		}
+		return !broken;
+	}
+
+	// Grows the buffer so n more bytes fit.
+	// n:	number of bytes
+	void reserve(int n) {
+		if (capacity - len < n) {
+			capacity = len + n;
+			data = (char*)realloc(data, capacity);
+		}
+	}
+
+	int fd;
+	char* data;
+	int capacity;
+	int len;
+	bool broken;
+};
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef MAILBOXES_H
+#define MAILBOXES_H
+
+#include <atomic>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <unordered_set>
+
+// constant integers
+const int READER_SHARDS 	= 64;
+const int RESCAN_SECONDS 	= 30;
+
+// Set of mailbox names ("user.mbox") in the mailbox directory, kept current while the server runs. Readers
+// look names up in an immutable snapshot without taking a lock. A watcher thread rescans the directory
+// whenever inotify reports a change (and every RESCAN_SECONDS as a fallback), publishes the new snapshot with
+// an atomic pointer swap, and frees the old one once every reader that could still see it has left.
+class MailboxRegistry {
+public:
+	MailboxRegistry(): current(new std::unordered_set< std::string >()), epoch(0) {
+		for (int i = 0; i < READER_SHARDS; i++) {
+			readers[i].count[0] = 0;
+			readers[i].count[1] = 0;
+		}
+	}
+
+	// Reads the mailbox directory and starts watching it. Returns false if the directory cannot be read.
+	// dir:	mailbox directory
+	bool start(const char* dir) {
+		this->dir = dir;
+		if (!rescan()) {
+			return false;
+		}
+
+		pthread_t thread;
+		pthread_create(&thread, NULL, &watch, this);
+		pthread_detach(thread);
+		return true;
+	}
+
+	// Returns true if the mailbox exists.
+	// mailbox:	mailbox file name, e.g. "user.mbox"
+	bool contains(const std::string& mailbox) {
+		// announce this reader in the current epoch; the counters are sharded so readers on different
+		// threads do not contend on one cache line
+		Shard& shard = readers[shard_index()];
+		int parity = epoch.load() & 1;
+		shard.count[parity].fetch_add(1);
+
+		std::unordered_set< std::string >* snapshot = current.load();
+		bool found = snapshot->find(mailbox) != snapshot->end();
+
+		shard.count[parity].fetch_sub(1);
+		return found;
+	}
+
+private:
+	struct alignas(64) Shard {
+		std::atomic< long > count[2];
+	};
+
+	// Watcher thread. Rescans the directory on every batch of inotify events, or periodically if inotify is
+	// not available.
+	// arg:	the registry
+	static void* watch(void* arg) {
+		MailboxRegistry* registry = (MailboxRegistry*)arg;
+		int notify_fd = inotify_init1(IN_CLOEXEC);
+		if (notify_fd >= 0) {
+			inotify_add_watch(notify_fd, registry->dir.c_str(),
+				IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+		}
+
+		char events[4096];
+		while (true) {
+			if (notify_fd >= 0) {
+				struct pollfd pfd;
+				pfd.fd = notify_fd;
+				pfd.events = POLLIN;
+				if (poll(&pfd, 1, RESCAN_SECONDS * 1000) > 0) {
+					read(notify_fd, events, sizeof(events));
+				}
+			} else {
+				sleep(RESCAN_SECONDS);
+			}
+			registry->rescan();
+		}
+		return NULL;
+	}
+
+	// Builds a new snapshot from the directory and publishes it. Only the watcher calls this after start().
+	bool rescan() {
+		DIR* mbdir = opendir(dir.c_str());
+		if (mbdir == NULL) {
+			return false;
+		}
+
+		std::unordered_set< std::string >* next = new std::unordered_set< std::string >();
+		struct dirent* entry;
+		while ((entry = readdir(mbdir)) != NULL) {
+			int len = strlen(entry->d_name);
+			if (len > 5 && strcmp(entry->d_name + len - 5, ".mbox") == 0) {
+				next->insert(std::string(entry->d_name));
+			}
+		}
+		closedir(mbdir);
+
+		publish(next);
+		return true;
+	}
+
+	// Swaps in a new snapshot, then flips the epoch and waits until no reader is left in the old one. A reader
+	// that registers after the flip, or after the wait has seen its shard empty, loads the new snapshot.
+	void publish(std::unordered_set< std::string >* next) {
+		std::unordered_set< std::string >* old = current.exchange(next);
+		int parity = epoch.fetch_add(1) & 1;
+
+		for (int i = 0; i < READER_SHARDS; i++) {
+			while (readers[i].count[parity].load() != 0) {
+				sched_yield();
+			}
+		}
+		delete old;
+	}
+
+	// Index of the calling thread's reader shard, assigned round robin on first use.
+	static int shard_index() {
+		static std::atomic< int > next_shard(0);
+		static thread_local int shard = next_shard.fetch_add(1) % READER_SHARDS;
+		return shard;
+	}
+
+	std::string dir;
+	std::atomic< std::unordered_set< std::string >* > current;
+	std::atomic< long > epoch;
+	Shard readers[READER_SHARDS];
+};
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef MBOXCACHE_H
+#define MBOXCACHE_H
+
+#include <list>
+#include <memory>
+#include <pthread.h>
+#include <string>
+#include <sys/stat.h>
+#include <unordered_map>
+#include <vector>
+#include "mboxindex.h"
+
+// One state of a mailbox and its index. A delivery changes the mailbox's size, a tombstone or an appended
+// record changes the index's size or modification time, and a rebuild or a compaction replaces a file.
+struct MailboxGeneration {
+	dev_t dev;
+	ino_t mbox_ino;
+	off_t mbox_size;
+	struct timespec mbox_mtime;
+	ino_t index_ino;
+	off_t index_size;
+	struct timespec index_mtime;
+};
+
+// Reads the generation of a mailbox. Returns false if the mailbox has no index.
+// mbox_fd:		open mailbox
+// index_path:	path of the mailbox's index
+// generation:	set to the generation
+inline bool mailbox_generation(int mbox_fd, const std::string& index_path, MailboxGeneration* generation) {
+	struct stat mbox;
+	struct stat index;
+	if (fstat(mbox_fd, &mbox) < 0 || stat(index_path.c_str(), &index) < 0) {
+		return false;
+	}
+
+	memset(generation, 0, sizeof(*generation));
+	generation->dev = mbox.st_dev;
+	generation->mbox_ino = mbox.st_ino;
+	generation->mbox_size = mbox.st_size;
+	generation->mbox_mtime = mbox.st_mtim;
+	generation->index_ino = index.st_ino;
+	generation->index_size = index.st_size;
+	generation->index_mtime = index.st_mtim;
+	return true;
+}
+
+// Returns true if two generations are the same state.
+inline bool same_generation(const MailboxGeneration& a, const MailboxGeneration& b) {
+	return a.dev == b.dev && a.mbox_ino == b.mbox_ino && a.mbox_size == b.mbox_size
+		&& a.mbox_mtime.tv_sec == b.mbox_mtime.tv_sec && a.mbox_mtime.tv_nsec == b.mbox_mtime.tv_nsec
+		&& a.index_ino == b.index_ino && a.index_size == b.index_size
+		&& a.index_mtime.tv_sec == b.index_mtime.tv_sec && a.index_mtime.tv_nsec == b.index_mtime.tv_nsec;
+}
+
+// The live messages of one generation of a mailbox. Never changed once published, so any number of sessions
+// can share it; it is freed when the cache and the last of those sessions have let go of it.
+struct MailboxSnapshot {
+	MailboxGeneration generation;
+	std::vector< IndexRecord > records;
+};
+
+// Process-wide cache of mailbox snapshots, so sessions of a mailbox that has not changed since the last login
+// share its records instead of each reading and holding a copy. Snapshots are evicted least recently used
+// first once they take more than the budget; sessions still using an evicted snapshot keep it alive.
+//
+// A generation check catches changes made by any process, within the resolution of file timestamps. Changes
+// made by this process also drop the mailbox's entry outright, before they are written.
+class MailboxCache {
+public:
+	MailboxCache(): budget(0), used(0) {
+		pthread_mutex_init(&lock, NULL);
+	}
+
+	// Sets the memory the cached snapshots may take. 0 disables the cache.
+	// bytes:	memory budget
+	void set_budget(size_t bytes) {
+		pthread_mutex_lock(&lock);
+		budget = bytes;
+		evict();
+		pthread_mutex_unlock(&lock);
+	}
+
+	// Returns the snapshot of a mailbox if it is of the given generation, or NULL.
+	// user:		user name of the .mbox file
+	// generation:	current generation of the mailbox
+	std::shared_ptr< const MailboxSnapshot > find(const std::string& user, const MailboxGeneration& generation) {
+		std::shared_ptr< const MailboxSnapshot > snapshot;
+		pthread_mutex_lock(&lock);
+		std::unordered_map< std::string, Entry >::iterator it = entries.find(user);
+		if (it != entries.end() && same_generation(it->second.snapshot->generation, generation)) {
+			snapshot = it->second.snapshot;
+			lru.splice(lru.begin(), lru, it->second.position);
+		}
+		pthread_mutex_unlock(&lock);
+		return snapshot;
+	}
+
+	// Caches the snapshot of a mailbox in place of any older one.
+	// user:		user name of the .mbox file
+	// snapshot:	snapshot read while holding the mailbox's lock
+	void insert(const std::string& user, std::shared_ptr< const MailboxSnapshot > snapshot) {
+		pthread_mutex_lock(&lock);
+		drop(user);
+		Entry& entry = entries[user];
+		entry.snapshot = snapshot;
+		entry.bytes = sizeof(MailboxSnapshot) + snapshot->records.capacity() * sizeof(IndexRecord) + user.length();
+		lru.push_front(user);
+		entry.position = lru.begin();
+		used += entry.bytes;
+		evict();
+		pthread_mutex_unlock(&lock);
+	}
+
+	// Forgets the snapshot of a mailbox that is about to change.
+	// user:	user name of the .mbox file
+	void invalidate(const std::string& user) {
+		pthread_mutex_lock(&lock);
+		drop(user);
+		pthread_mutex_unlock(&lock);
+	}
+
+private:
+	MailboxCache(const MailboxCache&);
+	MailboxCache& operator=(const MailboxCache&);
+
+	struct Entry {
+		std::shared_ptr< const MailboxSnapshot > snapshot;
+		std::list< std::string >::iterator position;
+		size_t bytes;
+	};
+
+	// Removes a mailbox's entry, if any. Called with the lock held.
+	void drop(const std::string& user) {
+		std::unordered_map< std::string, Entry >::iterator it = entries.find(user);
+		if (it != entries.end()) {
+			used -= it->second.bytes;
+			lru.erase(it->second.position);
+			entries.erase(it);
+		}
+	}
+
+	// Removes least recently used entries until the rest fit the budget. Called with the lock held.
+	void evict() {
+		while (used > budget && !lru.empty()) {
+			std::string user = lru.back();
+			drop(user);
+		}
+	}
+
+	std::unordered_map< std::string, Entry > entries;
+	// most recently used first
+	std::list< std::string > lru;
+	size_t budget;
+	size_t used;
+	pthread_mutex_t lock;
+};
+
+#endif
@@ -0,0 +1,413 @@
+#ifndef MBOXINDEX_H
+#define MBOXINDEX_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include "uidhash.h"
+
+// Sidecar index of a mailbox, kept next to it as <user>.mbox.idx. It holds one fixed-size record per message,
+// so a POP3 session can count, size and locate messages without reading any body. smtp appends a record with
+// every message it delivers; pop3 rebuilds the index from the mailbox whenever it does not match.
+//
+// The header records the mailbox size the index describes and the scheme of its unique ids. Both files are only changed while holding the
+// mailbox's flock(), and an index whose header does not match the mailbox, or the configured scheme, is stale.
+//
+// Compaction replaces a mailbox with rename(), so a lock is only good if the file locked is still the one at
+// the mailbox's path; mailbox_lock() retries until it is. A POP3 session keeps reading the file it opened at
+// PASS, which stays intact, while deliveries go on to the new one.
+//
+// IndexReader and IndexWriter go through an index INDEX_CHUNK bytes at a time, so walking or rewriting the
+// index of a mailbox of any size takes a fixed amount of memory.
+
+// constant strings
+const char INDEX_MAGIC[8] 	= { 'M', 'B', 'O', 'X', 'I', 'D', 'X', '4' };
+const char INDEX_SUFFIX[] 	= ".idx";
+
+// constant integers
+const int INDEX_DELETED 	= 1;
+const int INDEX_STORED 		= 2;
+const int INDEX_DOTS 		= 4;
+const int UID_LEN 			= 36;
+const int INDEX_CHUNK 		= 65536;
+
+struct IndexHeader {
+	char magic[8];
+	// size of the mailbox covered by the records
+	int64_t mbox_size;
+	// UID_MD5 or UID_FAST
+	int32_t scheme;
+	int32_t unused;
+};
+
+struct IndexRecord {
+	// offset of the message's "From " line in the mailbox
+	int64_t offset;
+	// bytes the message takes in the mailbox, "From " line included
+	int64_t length;
+	// octets of the message as sent to a POP3 client
+	int64_t size;
+	// octets of the headers, the blank line after them included; size if the message has no body
+	int64_t header;
+	// INDEX_DELETED, INDEX_STORED (the body is in the shared store), INDEX_DOTS (some line starts with '.', so
+	// the message must be dot-stuffed when sent)
+	int32_t flags;
+	// unique id, '\0'-terminated
+	char uid[UID_LEN];
+};
+
+// Returns true if a mailbox is still the file at its path.
+// mbox_fd:		open mailbox
+// path:		path of the mailbox
+inline bool mailbox_current(int mbox_fd, const std::string& path) {
+	struct stat opened;
+	struct stat named;
+	return fstat(mbox_fd, &opened) == 0 && stat(path.c_str(), &named) == 0 && opened.st_ino == named.st_ino
+		&& opened.st_dev == named.st_dev;
+}
+
+// Opens a mailbox and locks it with flock(). Returns the mailbox, or -1 if it cannot be opened.
+// path:		path of the mailbox
+// flags:		flags for open()
+// operation:	LOCK_SH or LOCK_EX
+inline int mailbox_lock(const std::string& path, int flags, int operation) {
+	while (true) {
+		int mbox_fd = open(path.c_str(), flags, 0600);
+		if (mbox_fd < 0) {
+			return -1;
+		}
+		flock(mbox_fd, operation);
+		if (mailbox_current(mbox_fd, path)) {
+			return mbox_fd;
+		}
+		close(mbox_fd);
+	}
+}
+
+// Reads the header of an index, whether or not it matches the mailbox. Returns false if the index is missing
+// or damaged.
+// index_fd:	index file
+// header:		set to the header of the index
+// count:		set to the number of records
+inline bool index_header(int index_fd, IndexHeader* header, int64_t* count) {
+	struct stat st;
+	if (index_fd < 0 || fstat(index_fd, &st) < 0 || st.st_size < sizeof(*header)
+		|| (st.st_size - sizeof(*header)) % sizeof(IndexRecord) != 0
+		|| pread(index_fd, header, sizeof(*header), 0) != sizeof(*header)
+		|| memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0) {
+		return false;
+	}
+
+	*count = (st.st_size - sizeof(*header)) / sizeof(IndexRecord);
+	return true;
+}
+
+// Reads the records of an index, whether or not it matches the mailbox. Returns false if the index is missing
+// or damaged.
+// index_fd:	index file
+// records:		set to the records of the index
+// header:		set to the header of the index
+inline bool index_read(int index_fd, std::vector< IndexRecord >& records, IndexHeader* header) {
+	int64_t count;
+	if (!index_header(index_fd, header, &count)) {
+		return false;
+	}
+
+	size_t bytes = count * sizeof(IndexRecord);
+	records.resize(count);
+	return bytes == 0 || pread(index_fd, records.data(), bytes, sizeof(*header)) == bytes;
+}
+
+// Reads the index of a mailbox. Returns false if the index is missing, damaged or stale.
+// index_fd:	index file
+// mbox_size:	current size of the mailbox
+// scheme:		configured unique id scheme
+// records:		set to the records of the index
+inline bool index_load(int index_fd, off_t mbox_size, int scheme, std::vector< IndexRecord >& records) {
+	IndexHeader header;
+	return index_read(index_fd, records, &header) && header.mbox_size == mbox_size && header.scheme == scheme;
+}
+
+// Rewrites one record in place, e.g. to set INDEX_DELETED.
+// index_fd:	index file
+// i:			position of the record
+// record:		new contents of the record
+inline bool index_update(int index_fd, int64_t i, const IndexRecord& record) {
+	return pwrite(index_fd, &record, sizeof(record), sizeof(IndexHeader) + (off_t)i * sizeof(record))
+		== sizeof(record);
+}
+
+// Appends the record of a message that was just appended to the mailbox. Does nothing if the index was already
+// stale, since it is rebuilt in full on its next use. A new mailbox gets a new index.
+// index_fd:	index file
+// record:		record of the message; record.offset is the old size of the mailbox
+// scheme:		scheme of the record's unique id
+inline void index_append(int index_fd, IndexRecord& record, int scheme) {
+	struct stat st;
+	IndexHeader header;
+	if (fstat(index_fd, &st) < 0) {
+		return;
+	}
+
+	if (st.st_size == 0 && record.offset == 0) {
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+		header.scheme = scheme;
+	} else if (pread(index_fd, &header, sizeof(header), 0) != sizeof(header)
+		|| memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || header.mbox_size != record.offset
+		|| header.scheme != scheme || (st.st_size - sizeof(header)) % sizeof(IndexRecord) != 0) {
+		return;
+	}
+
+	// the header is written last, so an interrupted append leaves a stale index rather than a wrong one
+	off_t end = st.st_size > 0 ? st.st_size : sizeof(header);
+	header.mbox_size = 0;
+	if (st.st_size == 0 && pwrite(index_fd, &header, sizeof(header), 0) != sizeof(header)) {
+		return;
+	}
+	if (pwrite(index_fd, &record, sizeof(record), end) == sizeof(record)) {
+		header.mbox_size = record.offset + record.length;
+		pwrite(index_fd, &header, sizeof(header), 0);
+	}
+}
+
+// Reads an index a window of records at a time. Owns the index file once open() succeeds.
+class IndexReader {
+public:
+	IndexReader(): index_fd(-1), count(0), first(0), filled(0) {}
+	~IndexReader() { close(); }
+
+	// Starts reading an index, whether or not it matches the mailbox. Returns false if the index is missing or
+	// damaged, in which case the caller keeps the file.
+	// fd:		index file
+	// header:	set to the header of the index
+	bool open(int fd, IndexHeader* header) {
+		close();
+		if (!index_header(fd, header, &count)) {
+			count = 0;
+			return false;
+		}
+		index_fd = fd;
+		window.resize(INDEX_CHUNK / sizeof(IndexRecord));
+		return true;
+	}
+
+	// Closes the index file and frees the window.
+	void close() {
+		if (index_fd >= 0) {
+			::close(index_fd);
+		}
+		index_fd = -1;
+		count = 0;
+		first = 0;
+		filled = 0;
+		std::vector< IndexRecord >().swap(window);
+	}
+
+	// Number of records in the index.
+	int64_t size() {
+		return count;
+	}
+
+	// Returns the i-th record, valid until the next call. Reads the window starting at i if i is outside the
+	// current one; a record that cannot be read comes back zeroed.
+	// i:	position of the record, less than size()
+	const IndexRecord& record(int64_t i) {
+		if (i < first || i >= first + filled) {
+			int64_t n = count - i < (int64_t)window.size() ? count - i : window.size();
+			ssize_t rlen = pread(index_fd, window.data(), n * sizeof(IndexRecord),
+				sizeof(IndexHeader) + i * sizeof(IndexRecord));
+			first = i;
+			filled = rlen > 0 ? rlen / sizeof(IndexRecord) : 0;
+			if (filled == 0) {
+				memset(window.data(), 0, sizeof(IndexRecord));
+				filled = 1;
+			}
+		}
+		return window[i - first];
+	}
+
+	// Rewrites the i-th record in place, in the file and in the window. The index must have been opened
+	// for writing.
+	// i:		position of the record
+	// record:	new contents of the record
+	bool update(int64_t i, const IndexRecord& record) {
+		if (i >= first && i < first + filled) {
+			window[i - first] = record;
+		}
+		return index_update(index_fd, i, record);
+	}
+
+private:
+	IndexReader(const IndexReader&);
+	IndexReader& operator=(const IndexReader&);
+
+	int index_fd;
+	int64_t count;
+	// position of the first record in the window, and the number of records read into it
+	int64_t first;
+	int64_t filled;
+	std::vector< IndexRecord > window;
+};
+
+// Writes a new index next to the one it replaces, INDEX_CHUNK bytes at a time. The new index takes the old
+// one's place at commit(); a writer destroyed before that removes its file.
+class IndexWriter {
+public:
+	IndexWriter(): index_fd(-1), ok(false) {}
+	~IndexWriter() {
+		if (index_fd >= 0) {
+			close(index_fd);
+			unlink(next_path.c_str());
+		}
+	}
+
+	// Starts the new index. Returns false if it cannot be created.
+	// path:	path of the index to replace
+	bool open(const std::string& path) {
+		this->path = path;
+		next_path = path + ".new";
+		index_fd = ::open(next_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+		// the header is filled in at commit()
+		IndexHeader header;
+		memset(&header, 0, sizeof(header));
+		ok = index_fd >= 0 && write(index_fd, &header, sizeof(header)) == sizeof(header);
+		pending.reserve(INDEX_CHUNK / sizeof(IndexRecord));
+		return ok;
+	}
+
+	// Adds the next record.
+	// record:	record of the next message in the mailbox
+	void add(const IndexRecord& record) {
+		pending.push_back(record);
+		if (pending.size() == pending.capacity()) {
+			flush();
+		}
+	}
+
+	// Finishes the new index and renames it over the old one. Returns false if anything failed, in which case
+	// the old index is left alone.
+	// mbox_size:	size of the mailbox the records describe
+	// scheme:		scheme of the records' unique ids
+	bool commit(off_t mbox_size, int scheme) {
+		flush();
+		IndexHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+		header.mbox_size = mbox_size;
+		header.scheme = scheme;
+		ok = ok && pwrite(index_fd, &header, sizeof(header), 0) == sizeof(header);
+
+		if (index_fd >= 0) {
+			close(index_fd);
+			index_fd = -1;
+		}
+		if (!ok || rename(next_path.c_str(), path.c_str()) < 0) {
+			unlink(next_path.c_str());
+			return false;
+		}
+		return true;
+	}
+
+private:
+	IndexWriter(const IndexWriter&);
+	IndexWriter& operator=(const IndexWriter&);
+
+	void flush() {
+		size_t bytes = pending.size() * sizeof(IndexRecord);
+		ok = ok && (bytes == 0 || write(index_fd, pending.data(), bytes) == bytes);
+		pending.clear();
+	}
+
+	std::string path;
+	std::string next_path;
+	int index_fd;
+	bool ok;
+	std::vector< IndexRecord > pending;
+};
+
+// Replaces the index of a mailbox with the given records.
+// path:		path of the index
+// mbox_size:	size of the mailbox the records describe
+// scheme:		scheme of the records' unique ids
+// records:		records of the index
+inline bool index_write(const std::string& path, off_t mbox_size, int scheme, std::vector< IndexRecord >& records) {
+	IndexWriter writer;
+	if (!writer.open(path)) {
+		return false;
+	}
+	for (size_t i = 0; i < records.size(); i++) {
+		writer.add(records[i]);
+	}
+	return writer.commit(mbox_size, scheme);
+}
+
+// Reads a message's content once to fill in its record: the unique id, which is the digest of the content in
+// the given scheme, the length of the headers and INDEX_DOTS.
+// fd:		file holding the content
+// offset:	start of the content in the file
+// len:		length of the content
+// scheme:	unique id scheme
+// record:	record of the message
+inline void index_content(int fd, off_t offset, off_t len, int scheme, IndexRecord& record) {
+	UidHash* hash = new_uid_hash(scheme);
+
+	char buffer[INDEX_CHUNK];
+	bool line_start = true;
+	bool dots = false;
+	// content offsets of the buffer and of the current line, and the line's first byte
+	int64_t pos = 0;
+	int64_t line = 0;
+	char first = '\0';
+	record.header = -1;
+	while (len > 0) {
+		ssize_t rlen = pread(fd, buffer, len < INDEX_CHUNK ? len : INDEX_CHUNK, offset);
+		if (rlen <= 0) {
+			break;
+		}
+		hash->update(buffer, rlen);
+
+		// look for "\n." without caring where the chunks split
+		char* p = buffer;
+		char* end = buffer + rlen;
+		dots = dots || (line_start && buffer[0] == '.');
+		while (!dots && (p = (char*)memchr(p, '\n', end - p)) != NULL && ++p < end) {
+			dots = *p == '.';
+		}
+		line_start = buffer[rlen - 1] == '\n';
+
+		// the headers end with the first empty line, "\r\n" or "\n"
+		for (p = buffer; record.header < 0 && (p = (char*)memchr(p, '\n', end - p)) != NULL; p++) {
+			int64_t at = pos + (p - buffer);
+			if (at == line || (at == line + 1 && (line >= pos ? buffer[line - pos] : first) == '\r')) {
+				record.header = at + 1;
+			}
+			line = at + 1;
+		}
+		if (line >= pos && line < pos + rlen) {
+			first = buffer[line - pos];
+		}
+
+		pos += rlen;
+		offset += rlen;
+		len -= rlen;
+	}
+
+	hash->final(record.uid);
+	delete hash;
+	if (dots) {
+		record.flags |= INDEX_DOTS;
+	}
+	if (record.header < 0) {
+		record.header = pos;
+	}
+}
+
+#endif
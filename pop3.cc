@@ -1,19 +1,36 @@
+#include <algorithm>
 #include <arpa/inet.h>
+#include <deque>
 #include <dirent.h>
-#include <fstream>
+#include <errno.h>
+#include <fcntl.h>
 #include <iostream>
-#include <openssl/md5.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include "linebuffer.h"
+#include "mailboxes.h"
+#include "mboxcache.h"
+#include "mboxindex.h"
+#include "scheduler.h"
+
 using namespace std;
 
 // constant strings
@@ -27,11 +44,15 @@ const char* NO_MESSAGE			 = "-ERR No such message\r\n";
 const char* DELETED 			 = "+OK Message deleted\r\n";
 const char* UNRECGONIZED_COMMAND = "-ERR Not supported\r\n";
 const char* UIDL_ALL 			 = "+OK Unique-id listing follows\r\n";
+const char* CAPABILITIES 		 = "+OK Capability list follows\r\nUSER\r\nTOP\r\nUIDL\r\nPIPELINING\r\n.\r\n";
+const char* TOP_FOLLOWS 		 = "+OK Top of message follows\r\n";
 const char* BAD_SEQUENCE 		 = "-ERR Bad sequence of commands\r\n";
 const char* RESET 				 = "+OK Messages reset\r\n";
 const char* SERVICE_UNAVAILABLE  = "-ERR Service not available, closing transmission channel\r\n";
+const char* SERVER_BUSY 		 = "-ERR Server busy, try again later\r\n";
 const char* QUIT 				 = "+OK POP3 server signing off\r\n";
 const char* CLOSE_CONN 			 = "Connection closed\r\n";
+const char* STORE_REF 			 = "X-Store-Ref: ";
 
 // constant integers
 const int BUFFER_SIZE 	= 1024;
@@ -40,47 +61,235 @@ const int MAILBOX_LEN 	= 64;
 const int AUTHORIZATION = 0;
 const int TRANSACTION 	= 1;
 const int UPDATE 		= 2;
+const int IOV_BATCH 	= 1024;
+const int TOP_CHUNK 	= 4096;
+const int SNAPSHOT_LIMIT = 65536;
+const int REBUILD_BATCH = 4096;
+const int MAP_WINDOW 	= 1 << 22;
+const int OUTPUT_SIZE 	= 65536;
+const int LISTING_LINE 	= 64;
+
+// constant doubles
+const double COMPACT_RATIO = 0.25;
 
 // global variables
 vector< pthread_t > THREADS;
 vector< int > SOCKETS;
 char* PARENTDIR;
-unordered_set< string > MAILBOXES;
+MailboxRegistry MAILBOXES;
 bool DEBUG = false;
+int ACCEPTORS = 1;
+int BACKLOG = 100;
+bool PIN_CPUS = false;
+vector< int > LISTENERS;
+pthread_mutex_t REGISTRY_LOCK = PTHREAD_MUTEX_INITIALIZER;
+int WORKERS = 0;
+int QUEUE_DEPTH = 1000;
+int EVENT_LOOPS = 0;
+vector< Scheduler* > SCHEDULERS;
+int UID_SCHEME = UID_MD5;
+long CACHE_MB = 64;
+MailboxCache CACHE;
+
+// bounded queue of accepted sockets waiting for a pool worker. Only the dispatcher pushes, and workers hold
+// the lock just long enough to pop one socket.
+struct ConnectionQueue {
+	vector< int > fds;
+	int head;
+	int count;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+};
+ConnectionQueue QUEUE;
 
-// wrapper class for message
-class Message {
-public:
-	string content;
-	bool deleted;
+// mailboxes waiting for the compactor, which rewrites them without their deleted messages
+struct CompactQueue {
+	unordered_set< string > users;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+};
+CompactQueue COMPACTIONS;
+
+// messages of one mailbox whose index is being rebuilt, hashed one at a time by the hash helpers and by the
+// thread doing the rebuild
+struct HashBatch {
+	// file holding each message's content and where it starts
+	vector< int > fds;
+	vector< off_t > offsets;
+	vector< IndexRecord >* records;
+	int next;
+	int unfinished;
+};
 
+// an index being rebuilt: the batch of messages found in the mailbox but not finished yet, the stale index
+// whose deletions carry over, and the new index
+struct IndexRebuild {
+	int mbox_fd;
+	char* user;
+	vector< IndexRecord > records;
+	// where each message's body starts
+	vector< off_t > bodies;
+	IndexReader stale;
+	// next record of the stale index to compare
+	int64_t stale_next;
+	bool same_scheme;
+	IndexWriter index;
+};
+
+// helper threads that hash messages for index rebuilds, one per CPU beyond the first
+struct HashPool {
+	deque< HashBatch* > batches;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t done;
+};
+HashPool HASHERS;
+
+// messages of a session. The index records are the snapshot of the mailbox taken at PASS, shared with every
+// session that logged in to the same generation of it; only the session's DELE marks are its own, and those
+// are allocated at the first DELE. The content stays in the mailbox and is read, or sent, when a command
+// needs it.
+//
+// A mailbox of more than SNAPSHOT_LIMIT messages is not copied into memory. The session keeps the index file
+// it opened at PASS, which later deliveries only append to and a rebuild or a compaction replaces without
+// touching, and reads records from it a window at a time. Only the positions of the messages that were already
+// deleted then are kept, to number the live ones.
+class MessageList {
 public:
-	Message(string content): content(content), deleted() {}
+	MessageList(): live(0) {}
+
+	// Starts the session's view of a mailbox.
+	// snapshot:	live messages of the mailbox
+	void open(shared_ptr< const MailboxSnapshot > snapshot) {
+		index.close();
+		tombstones.clear();
+		this->snapshot = snapshot;
+		live = snapshot->records.size();
+		deletions.clear();
+	}
+
+	// Starts the session's view of a mailbox too large to snapshot. Takes the index file, which matches the
+	// mailbox.
+	// index_fd:	index of the mailbox
+	void open(int index_fd) {
+		snapshot.reset();
+		tombstones.clear();
+		deletions.clear();
+		IndexHeader header;
+		if (!index.open(index_fd, &header)) {
+			close(index_fd);
+		}
+		for (int64_t i = 0; i < index.size(); i++) {
+			if (index.record(i).flags & INDEX_DELETED) {
+				tombstones.push_back(i);
+			}
+		}
+		live = index.size() - tombstones.size();
+	}
+
+	int size() {
+		return live;
+	}
+
+	// place, size and unique id of the i-th message, from the mailbox's index. Valid until the next call.
+	const IndexRecord& entry(int i) {
+		if (snapshot) {
+			return snapshot->records[i];
+		}
+		return index.record(position(i));
+	}
+
+	bool deleted(int i) {
+		return !deletions.empty() && deletions[i];
+	}
+
+	// Marks the i-th message as deleted.
+	void remove(int i) {
+		if (deletions.empty()) {
+			deletions.resize(size(), false);
+		}
+		deletions[i] = true;
+	}
+
+	// Unmarks every message.
+	void restore() {
+		deletions.clear();
+	}
+
+private:
+	// Returns the position in the index of the i-th live message: i plus the tombstones before it. The k-th
+	// tombstone comes before the i-th live message if there are at most i live messages ahead of it.
+	int64_t position(int i) {
+		size_t low = 0;
+		size_t high = tombstones.size();
+		while (low < high) {
+			size_t mid = (low + high) / 2;
+			if (tombstones[mid] - (int64_t)mid <= i) {
+				low = mid + 1;
+			} else {
+				high = mid;
+			}
+		}
+		return i + low;
+	}
+
+	shared_ptr< const MailboxSnapshot > snapshot;
+	IndexReader index;
+	// index positions of the messages already deleted when the index was opened
+	vector< int64_t > tombstones;
+	int live;
+	vector< bool > deletions;
 };
 
 // function signatures
 void signal_handler(int arg);
 void get_mailboxes();
+int open_listener(unsigned short port);
+void accept_loop(int index);
+void* acceptor(void* arg);
 void* worker(void* arg);
-void handle_user(int comm_fd, int* state, char* buffer, char* user);
-void handle_pass(int comm_fd, int* state, char* buffer, char* user, vector< Message >& messages);
-void handle_stat(int comm_fd, int* state, vector< Message >& messages);
-void handle_list(int comm_fd, int* state, char* buffer, vector< Message >& messages);
-void handle_uidl(int comm_fd, int* state, char* buffer, vector< Message >& messages);
-void handle_retr(int comm_fd, int* state, char* buffer, vector< Message >& messages);
-void handle_dele(int comm_fd, int* state, char* buffer, vector< Message >& messages);
-void handle_noop(int comm_fd, int* state);
-void handle_rset(int comm_fd, int* state, vector< Message >& messages);
-void handle_quit(int comm_fd, int* state, char* user, vector< Message >& messages, bool* quit);
-void write_response(int comm_fd, const char* response);
+void* pool_worker(void* arg);
+void* scheduler_loop(void* arg);
+Task< bool > serve_session(int comm_fd, Scheduler* scheduler);
+bool queue_push(ConnectionQueue* queue, int fd);
+int queue_pop(ConnectionQueue* queue);
+void handle_user(OutputBuffer& out, int* state, char* buffer, char* user);
+void handle_pass(OutputBuffer& out, int* state, char* buffer, char* user, int* mbox_fd, MessageList& messages);
+void handle_stat(OutputBuffer& out, int* state, MessageList& messages);
+Task< bool > handle_list(Connection& conn, int* state, char* buffer, MessageList& messages);
+Task< bool > handle_uidl(Connection& conn, int* state, char* buffer, MessageList& messages);
+Task< bool > handle_retr(Connection& conn, int* state, char* buffer, char* user, int mbox_fd, MessageList& messages);
+Task< bool > handle_top(Connection& conn, int* state, char* buffer, char* user, int mbox_fd, MessageList& messages);
+void handle_capa(OutputBuffer& out);
+void handle_dele(OutputBuffer& out, int* state, char* buffer, MessageList& messages);
+void handle_noop(OutputBuffer& out, int* state);
+void handle_rset(OutputBuffer& out, int* state, MessageList& messages);
+void handle_quit(OutputBuffer& out, int* state, char* user, MessageList& messages, bool* quit);
+void expunge(char* user, MessageList& messages);
+void add_tombstone(IndexReader& index, int64_t i, int mbox_fd, char* user);
+void* compactor(void* arg);
+void compact(const string& user);
+off_t dead_bytes(IndexReader& index);
+void* hash_helper(void* arg);
+void hash_batch(HashPool* pool, HashBatch* batch);
+int claim_message(HashPool* pool, HashBatch* batch);
+void hash_message(HashBatch* batch, int i);
+void write_response(OutputBuffer& out, const char* response);
 void copy_command(char* dest, char* src);
-void read_file(vector< Message >& messages, char* src);
-void list_all(int comm_fd, vector< Message >& messages);
-void list_one(int comm_fd, char* command, vector< Message >& messages);
-void uidl_all(int comm_fd, vector< Message >& messages);
-void uidl_one(int comm_fd, char* command, vector< Message >& messages);
-void computeDigest(char *data, int dataLengthBytes, unsigned char *digestBuffer);
-void remove_command(char* buf, char* end);
+int read_file(MessageList& messages, char* src);
+int open_index(int mbox_fd, char* user, int flags);
+int current_index(int mbox_fd, char* user, int flags);
+void rebuild_index(int mbox_fd, char* user);
+void rebuild_batch(IndexRebuild* rebuild);
+int open_body(int mbox_fd, char* user, const IndexRecord& entry, off_t* offset);
+off_t top_length(int body_fd, off_t offset, const IndexRecord& entry, int lines);
+Task< bool > send_message(Connection& conn, int body_fd, off_t offset, off_t len, bool stuff);
+Task< bool > send_stuffed(Connection& conn, char* piece, off_t len, bool line_start);
+string store_path(int mbox_fd, const IndexRecord& entry, char* user);
+Task< bool > list_all(Connection& conn, MessageList& messages);
+void list_one(OutputBuffer& out, char* command, MessageList& messages);
+Task< bool > uidl_all(Connection& conn, MessageList& messages);
+void uidl_one(OutputBuffer& out, char* command, MessageList& messages);
 
 
 // Main function of the program. Also the dispatcher of worker threads. This function parses command line 
@@ -93,7 +302,7 @@ int main(int argc, char *argv[]) {
 	// port defaults to 11000 if no arguments given
 	unsigned short port = 11000;
 
-	while ((option = getopt(argc, argv, "p:av")) != -1) {
+	while ((option = getopt(argc, argv, "p:avt:q:l:b:cu:m:e:")) != -1) {
 		switch(option) {
 		case 'p':
 			port = atoi(optarg);
@@ -107,21 +316,118 @@ int main(int argc, char *argv[]) {
 			DEBUG = true;
 			break;
 
+		case 't':
+			WORKERS = atoi(optarg);
+			break;
+
+		case 'q':
+			QUEUE_DEPTH = atoi(optarg);
+			break;
+
+		case 'l':
+			ACCEPTORS = atoi(optarg) > 0 ? atoi(optarg) : 1;
+			break;
+
+		case 'b':
+			BACKLOG = atoi(optarg);
+			break;
+
+		case 'c':
+			PIN_CPUS = true;
+			break;
+
+		case 'u':
+			UID_SCHEME = uid_scheme(optarg) >= 0 ? uid_scheme(optarg) : UID_MD5;
+			break;
+
+		case 'm':
+			CACHE_MB = atol(optarg) > 0 ? atol(optarg) : 0;
+			break;
+
+		case 'e':
+			EVENT_LOOPS = atoi(optarg);
+			break;
+
 		default:
-			cerr << "Usage: " << argv[0] << " [-p port number] [-a] [-v] <mailbox directory>\r\n";
+			cerr << "Usage: " << argv[0] << " [-p port number] [-a] [-v] [-l acceptors] [-b backlog] [-c] [-t workers] "
+				<< "[-q queue depth] [-e event loops] [-u md5|fast] [-m cache megabytes] <mailbox directory>\r\n";
 			exit(1);
 		}
 	}
 
 	// if no mailbox directory given
 	if (optind == argc) {
-		cerr << "Usage: " << argv[0] << " [-p port number] [-a] [-v] <mailbox directory>\r\n";
+		cerr << "Usage: " << argv[0] << " [-p port number] [-a] [-v] [-l acceptors] [-b backlog] [-c] [-t workers] "
+			<< "[-q queue depth] [-e event loops] [-u md5|fast] [-m cache megabytes] <mailbox directory>\r\n";
 		exit(1);
 	}
-	PARENTDIR = (char*)malloc(sizeof(char*));
-	strcpy(PARENTDIR, argv[optind]);
+	PARENTDIR = strdup(argv[optind]);
+	CACHE.set_budget(CACHE_MB << 20);
 	get_mailboxes();
 
+	// one listening socket per acceptor. With more than one, SO_REUSEPORT lets the kernel spread incoming
+	// connections across them.
+	for (int i = 0; i < ACCEPTORS; i++) {
+		LISTENERS.push_back(open_listener(port));
+	}
+
+	// with -t, a fixed pool of workers serves connections from a bounded queue
+	QUEUE.fds.resize(QUEUE_DEPTH > 0 ? QUEUE_DEPTH : 1);
+	QUEUE.head = 0;
+	QUEUE.count = 0;
+	pthread_mutex_init(&QUEUE.lock, NULL);
+	pthread_cond_init(&QUEUE.not_empty, NULL);
+
+	for (int i = 0; i < WORKERS; i++) {
+		pthread_t thread;
+		pthread_create(&thread, NULL, &pool_worker, &QUEUE);
+		THREADS.push_back(thread);
+	}
+
+	// with -e, sessions are coroutines multiplexed over a few scheduler threads instead
+	for (int i = 0; i < EVENT_LOOPS; i++) {
+		Scheduler* scheduler = new Scheduler();
+		if (!scheduler->start()) {
+			cerr << "Error creating event loop\r\n";
+			exit(1);
+		}
+		SCHEDULERS.push_back(scheduler);
+
+		pthread_t thread;
+		pthread_create(&thread, NULL, &scheduler_loop, scheduler);
+		THREADS.push_back(thread);
+	}
+
+	pthread_mutex_init(&COMPACTIONS.lock, NULL);
+	pthread_cond_init(&COMPACTIONS.not_empty, NULL);
+	pthread_t compaction_thread;
+	pthread_create(&compaction_thread, NULL, &compactor, &COMPACTIONS);
+	THREADS.push_back(compaction_thread);
+
+	pthread_mutex_init(&HASHERS.lock, NULL);
+	pthread_cond_init(&HASHERS.not_empty, NULL);
+	pthread_cond_init(&HASHERS.done, NULL);
+	for (int i = 1; i < sysconf(_SC_NPROCESSORS_ONLN); i++) {
+		pthread_t thread;
+		pthread_create(&thread, NULL, &hash_helper, &HASHERS);
+		THREADS.push_back(thread);
+	}
+
+	for (int i = 1; i < ACCEPTORS; i++) {
+		pthread_t thread;
+		pthread_create(&thread, NULL, &acceptor, (void*)(intptr_t)i);
+		pthread_mutex_lock(&REGISTRY_LOCK);
+		THREADS.push_back(thread);
+		pthread_mutex_unlock(&REGISTRY_LOCK);
+	}
+	accept_loop(0);
+
+	return 0;
+}
+
+// Opens a listening socket on the given port. Exits if the socket cannot be set up.
+// port:	port number to listen on
+int open_listener(unsigned short port) {
 	// connect to socket
 	int listen_fd = socket(PF_INET, SOCK_STREAM, 0);
 	if (listen_fd < 0) {
@@ -131,9 +437,12 @@ int main(int argc, char *argv[]) {
 
 	SOCKETS.push_back(listen_fd);
 	
-	// set port as reusable
+	// set port as reusable, and shareable between acceptors
 	const int enable = 1;
 	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
+	if (ACCEPTORS > 1) {
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int));
+	}
 
 	// set up server
 	struct sockaddr_in servaddr;
@@ -142,9 +451,30 @@ int main(int argc, char *argv[]) {
 	servaddr.sin_addr.s_addr = htons(INADDR_ANY);
 	servaddr.sin_port = htons(port);
 
-	bind(listen_fd, (struct sockaddr*)&servaddr, sizeof(servaddr));
-	listen(listen_fd, 100);
+	if (bind(listen_fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
+		cerr << "Error binding socket\r\n";
+		exit(1);
+	}
+	listen(listen_fd, BACKLOG);
+
+	return listen_fd;
+}
+
+// Accepts connections on one listening socket and dispatches them. The first listener is served by main, the
+// others by acceptor threads.
+// index:	index of the listening socket in LISTENERS
+void accept_loop(int index) {
+	int listen_fd = LISTENERS[index];
+
+	// optionally pin each acceptor to its own core
+	if (PIN_CPUS) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(index % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
 
+	int next_loop = index;
 	while (true) {
 		// set up client connection
 		struct sockaddr_in clientaddr;
@@ -154,17 +484,43 @@ int main(int argc, char *argv[]) {
 		if (fd == -1) {
 			break;
 		}
+		pthread_mutex_lock(&REGISTRY_LOCK);
 		SOCKETS.push_back(fd);
+		pthread_mutex_unlock(&REGISTRY_LOCK);
 
 		if (DEBUG) cerr << "[" << fd << "] " << NEW_CONN;
 
+		if (EVENT_LOOPS > 0) {
+			// hand the connection to one of the schedulers, round robin
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+			SCHEDULERS[next_loop++ % EVENT_LOOPS]->post(fd);
+			continue;
+		}
+
+		if (WORKERS > 0) {
+			// all workers busy and the queue is full: reject instead of piling up
+			if (!queue_push(&QUEUE, fd)) {
+				write(fd, SERVER_BUSY, strlen(SERVER_BUSY));
+				close(fd);
+				if (DEBUG) cerr << "[" << fd << "] " << CLOSE_CONN;
+			}
+			continue;
+		}
+
 		pthread_t thread;
-		THREADS.push_back(thread);
 		// dispatch worker thread to handle client communication
-		pthread_create(&thread, NULL, &worker, &fd);
+		pthread_create(&thread, NULL, &worker, new int(fd));
+		pthread_mutex_lock(&REGISTRY_LOCK);
+		THREADS.push_back(thread);
+		pthread_mutex_unlock(&REGISTRY_LOCK);
 	}
+}
 
-	return 0;
+// Acceptor thread for an additional listening socket.
+// arg: index of the listening socket in LISTENERS
+void* acceptor(void* arg) {
+	accept_loop((intptr_t)arg);
+	pthread_exit(NULL);
 }
 
 // Handler of SIGINT. Once SIGINT is received, this function writes a message to clients, closes their 
@@ -177,148 +533,208 @@ void signal_handler(int arg) {
 	for (int i = 1; i < SOCKETS.size(); i++) {
 		write(SOCKETS[i], SERVICE_UNAVAILABLE, strlen(SERVICE_UNAVAILABLE));
 		close(SOCKETS[i]);
-		pthread_kill(THREADS[i - 1], 0);
+	}
+
+	for (int i = 0; i < THREADS.size(); i++) {
+		pthread_kill(THREADS[i], 0);
 	}
 }
 
-// Read the mailbox directory and add mailboxes to a hashset.
+// Load the mailbox directory into the registry, which keeps itself current as mailboxes are added or removed.
 void get_mailboxes() {
-	DIR* mbdir;
-	struct dirent* entry;
-
-	if ((mbdir = opendir(PARENTDIR)) != NULL) {
-		while ((entry = readdir(mbdir)) != NULL) {
-			if (strlen(entry->d_name) > 2) {
-				string mailbox(entry->d_name);
-				MAILBOXES.insert(mailbox);
-			}
-		}
-		closedir(mbdir);
-	} else {
+	if (!MAILBOXES.start(PARENTDIR)) {
 		cerr << "Mailbox directory does not exist\r\n";
 		exit(1);
 	}
 }
 
 // Worker thread that handles the connection. One thread for one client.
-// arg: file descriptor of the socket the client connects to.
+// arg: heap-allocated file descriptor of the socket the client connects to.
 void* worker(void* arg) {
 	int comm_fd = *(int*)arg;
-	write(comm_fd, SERVICE_READY, strlen(SERVICE_READY));
-	int state = AUTHORIZATION;
+	delete (int*)arg;
+
+	serve_session(comm_fd, NULL).detach();
+	pthread_exit(NULL);
+}
+
+// Pool worker thread used in -t mode. Serves queued connections one after another.
+// arg: queue of accepted sockets.
+void* pool_worker(void* arg) {
+	ConnectionQueue* queue = (ConnectionQueue*)arg;
+
+	while (true) {
+		serve_session(queue_pop(queue), NULL).detach();
+	}
+
+	pthread_exit(NULL);
+}
+
+// Scheduler thread used in -e mode. Runs the sessions of the connections handed to it.
+// arg: the thread's scheduler.
+void* scheduler_loop(void* arg) {
+	((Scheduler*)arg)->run(&serve_session);
+	pthread_exit(NULL);
+}
+
+// Adds an accepted socket to the queue. Returns false if the queue is full.
+// queue:	queue of accepted sockets
+// fd:		client's socket
+bool queue_push(ConnectionQueue* queue, int fd) {
+	pthread_mutex_lock(&queue->lock);
+	if (queue->count == queue->fds.size()) {
+		pthread_mutex_unlock(&queue->lock);
+		return false;
+	}
+
+	queue->fds[(queue->head + queue->count) % queue->fds.size()] = fd;
+	queue->count++;
+	pthread_mutex_unlock(&queue->lock);
+	pthread_cond_signal(&queue->not_empty);
+	return true;
+}
+
+// Removes the oldest socket from the queue, waiting until there is one.
+// queue:	queue of accepted sockets
+int queue_pop(ConnectionQueue* queue) {
+	pthread_mutex_lock(&queue->lock);
+	while (queue->count == 0) {
+		pthread_cond_wait(&queue->not_empty, &queue->lock);
+	}
 
-	// buffers for client's command
-	char buf[BUFFER_SIZE];
-	char* curr = buf;
+	int fd = queue->fds[queue->head];
+	queue->head = (queue->head + 1) % queue->fds.size();
+	queue->count--;
+	pthread_mutex_unlock(&queue->lock);
+	return fd;
+}
+
+// Handles one connection from greeting to close. Responses collect in an output buffer that is flushed once
+// every complete command read so far has been answered, so pipelined commands (RFC 2449 PIPELINING) are
+// answered in a single write; Nagle's algorithm is off since nothing is written a line at a time any more.
+// Without a scheduler the socket is blocking and the session runs to the end on the calling thread; on a
+// scheduler it suspends whenever the client is not ready and the thread serves other sessions meanwhile.
+// comm_fd:		client's socket
+// scheduler:	scheduler running the session, or NULL
+Task< bool > serve_session(int comm_fd, Scheduler* scheduler) {
+	int nodelay = 1;
+	setsockopt(comm_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+	// buffers for client's commands and the responses to them
+	Connection conn(comm_fd, BUFFER_SIZE, OUTPUT_SIZE, scheduler);
+	OutputBuffer& out = conn.out;
 	bool quit = false;
 
-	char user[MAILBOX_LEN];
-	vector< Message > messages;
+	write_response(out, SERVICE_READY);
+	int state = AUTHORIZATION;
 
-	// into one connection
-	while (!quit) {
-		int curr_len = strlen(buf);
-		int rlen = read(comm_fd, curr, BUFFER_SIZE - curr_len);
-		char* end = (char*)malloc(sizeof(char*));
+	char user[MAILBOX_LEN] = "";
+	int mbox_fd = -1;
+	MessageList messages;
 
-		// into one command - if command contains "<CR><LF>", enter loop
-		while ((end = strstr(buf, "\r\n")) != NULL) {
-			// move end to the end of "<CR><LF>"
-			end += 2;
+	// into one command - for every complete line ending with "<CR><LF>"; the replies go out before the session
+	// waits for more
+	char* buf;
+	int len;
+	while ((buf = co_await conn.read_line(&len)) != NULL) {
+		char* end = buf + len;
 
-			if (DEBUG) fprintf(stderr, "[%d] C: %.*s", comm_fd, (int)(end - buf), buf);
+		if (DEBUG) fprintf(stderr, "[%d] C: %.*s", comm_fd, (int)(end - buf), buf);
 
-			char command[COMMAND_LEN];
-			for (int i = 0; i < COMMAND_LEN; i++) {
-				command[i] = buf[i];
-			}
+		char command[COMMAND_LEN + 1];
+		for (int i = 0; i < COMMAND_LEN; i++) {
+			command[i] = buf[i];
+		}
+		command[COMMAND_LEN] = '\0';
 
-			// USER response
-			if (strcasecmp(command, "user") == 0) {
-				handle_user(comm_fd, &state, buf, user);
-			
-			// PASS response
-			} else if (strcasecmp(command, "pass") == 0) {
-				handle_pass(comm_fd, &state, buf, user, messages);
-			
-			// STAT response
-			} else if (strcasecmp(command, "stat") == 0) {
-				handle_stat(comm_fd, &state, messages);
-			
-			// LIST response
-			} else if (strcasecmp(command, "list") == 0) {
-				handle_list(comm_fd, &state, buf, messages);
-
-			// UIDL response
-			} else if (strcasecmp(command, "uidl") == 0) {
-				handle_uidl(comm_fd, &state, buf, messages);
-
-			// RETR response
-			} else if (strcasecmp(command, "retr") == 0) {
-				handle_retr(comm_fd, &state, buf, messages);
-
-			// DELE response
-			} else if (strcasecmp(command, "dele") == 0) {
-				handle_dele(comm_fd, &state, buf, messages);
-
-			// NOOP response
-			} else if (strcasecmp(command, "noop") == 0) {
-				handle_noop(comm_fd, &state);
-
-			// RSET response
-			} else if (strcasecmp(command, "rset") == 0) {
-				handle_rset(comm_fd, &state, messages);
-
-			// QUIT response
-			} else if (strcasecmp(command, "quit") == 0) {
-				handle_quit(comm_fd, &state, user, messages, &quit);
-
-			// unknown command response
-			} else {
-				write_response(comm_fd, UNRECGONIZED_COMMAND);
-			}
+		// USER response
+		if (strcasecmp(command, "user") == 0) {
+			handle_user(out, &state, buf, user);
+		
+		// PASS response
+		} else if (strcasecmp(command, "pass") == 0) {
+			handle_pass(out, &state, buf, user, &mbox_fd, messages);
+		
+		// STAT response
+		} else if (strcasecmp(command, "stat") == 0) {
+			handle_stat(out, &state, messages);
+		
+		// LIST response
+		} else if (strcasecmp(command, "list") == 0) {
+			co_await handle_list(conn, &state, buf, messages);
+
+		// UIDL response
+		} else if (strcasecmp(command, "uidl") == 0) {
+			co_await handle_uidl(conn, &state, buf, messages);
 
-			if (quit) break;
+		// RETR response
+		} else if (strcasecmp(command, "retr") == 0) {
+			co_await handle_retr(conn, &state, buf, user, mbox_fd, messages);
 
-			// clear buffer of one full command
-			remove_command(buf, end);
+		// TOP response
+		} else if (strncasecmp(command, "top", 3) == 0 && (command[3] == ' ' || command[3] == '\r')) {
+			co_await handle_top(conn, &state, buf, user, mbox_fd, messages);
+
+		// CAPA response
+		} else if (strcasecmp(command, "capa") == 0) {
+			handle_capa(out);
+
+		// DELE response
+		} else if (strcasecmp(command, "dele") == 0) {
+			handle_dele(out, &state, buf, messages);
+
+		// NOOP response
+		} else if (strcasecmp(command, "noop") == 0) {
+			handle_noop(out, &state);
+
+		// RSET response
+		} else if (strcasecmp(command, "rset") == 0) {
+			handle_rset(out, &state, messages);
+
+		// QUIT response
+		} else if (strcasecmp(command, "quit") == 0) {
+			handle_quit(out, &state, user, messages, &quit);
+
+		// unknown command response
+		} else {
+			write_response(out, UNRECGONIZED_COMMAND);
 		}
 
 		if (quit) break;
 
-		// reset curr to point to the end of buffer
-		curr = buf;
-		while (*curr != '\0') {
-			curr++;
-		}
-		free(end);
+		// clear buffer of one full command
+		conn.in.consume();
 	}
+	co_await conn.flush(false);
 
+	if (mbox_fd >= 0) {
+		close(mbox_fd);
+	}
 	close(comm_fd);
 	if (DEBUG) cerr << "[" << comm_fd << "] " << CLOSE_CONN;
-	pthread_exit(NULL);
+	co_return true;
 }
 
 // Handler for USER command. Checks whether the transaction is at the correct state and send response
 // accordingly. Checks if user exists.
-// comm_fd: 	client's socket
+// out:			client's output buffer
 // state: 		current transaction state
 // buffer:		master buffer for client's command
 // user:		buffer to record user name
-void handle_user(int comm_fd, int* state, char* buffer, char* user) {
+void handle_user(OutputBuffer& out, int* state, char* buffer, char* user) {
 	if (*state != AUTHORIZATION || strlen(user) != 0) {
-		write_response(comm_fd, BAD_SEQUENCE);
+		write_response(out, BAD_SEQUENCE);
 	} else {
 		char mailbox[MAILBOX_LEN];
 		copy_command(mailbox, buffer);
 		string mbox(mailbox);
 		mbox += ".mbox";
 
-		if (MAILBOXES.find(mbox) != MAILBOXES.end()) {
-			write_response(comm_fd, USER_EXISTS);
+		if (MAILBOXES.contains(mbox)) {
+			write_response(out, USER_EXISTS);
 			strcpy(user, mailbox);
 		} else {
-			write_response(comm_fd, NO_USER);
+			write_response(out, NO_USER);
 		}
 	}
 }
@@ -326,156 +742,217 @@ void handle_user(int comm_fd, int* state, char* buffer, char* user) {
 // Handler for PASS command. Checks whether the transaction is at the correct state and send response
 // accordingly. If the password is correct, enters transaction state and reads mails from mailbox; if not, 
 // user name is reset to  empty.
-// comm_fd: 	client's socket
+// out:			client's output buffer
 // state: 		current transaction state
 // buffer:		master buffer for client's command
 // user:		user name
+// mbox_fd:		set to the user's mailbox, which stays open for the session
 // messages:	container to keep track of messages
-void handle_pass(int comm_fd, int* state, char* buffer, char* user, vector< Message >& messages) {
+void handle_pass(OutputBuffer& out, int* state, char* buffer, char* user, int* mbox_fd, MessageList& messages) {
 	if (*state != AUTHORIZATION || strlen(user) == 0) {
-		write_response(comm_fd, BAD_SEQUENCE);
+		write_response(out, BAD_SEQUENCE);
 	} else {
 		char password[MAILBOX_LEN];
 		copy_command(password, buffer);
 
 		if (strcmp(password, "cis505") == 0) {
 			*state = TRANSACTION;
-			read_file(messages, user);
-			write_response(comm_fd, VALID_PASSWORD);
+			*mbox_fd = read_file(messages, user);
+			write_response(out, VALID_PASSWORD);
 		} else {
 			memset(user, 0, strlen(user));
-			write_response(comm_fd, INVALID_PASSWORD);
+			write_response(out, INVALID_PASSWORD);
 		}
 	}
 }
 
 // Handler for STAT command. Checks whether the transaction is at the correct state and send response
 // accordingly. Displays the number and total size of messages.
-// comm_fd: 	client's socket
+// out:			client's output buffer
 // state: 		current transaction state
 // messages:	messages in user's mailbox
-void handle_stat(int comm_fd, int* state, vector< Message >& messages) {
+void handle_stat(OutputBuffer& out, int* state, MessageList& messages) {
 	if (*state != TRANSACTION) {
-		write_response(comm_fd, BAD_SEQUENCE);
+		write_response(out, BAD_SEQUENCE);
 	} else {
 		string ok = "+OK ";
 		int count = 0;
-		int chars = 0;
+		int64_t chars = 0;
 
 		for (int i = 0; i < messages.size(); i++) {
-			if (!messages[i].deleted) {
+			if (!messages.deleted(i)) {
 				count++;
-				chars += messages[i].content.length();
+				chars += messages.entry(i).size;
 			}	
 		}
 
 		ok = ok + to_string(count) + " " + to_string(chars) + "\r\n";
-		write_response(comm_fd, ok.c_str());
+		write_response(out, ok.c_str());
 	}
 }
 
 // Handler for LIST command. Checks whether the transaction is at the correct state and send response
 // accordingly. Checks if LIST is followed by an argument and calls a corresponding helper function.
-// comm_fd: 	client's socket
+// conn:			client's connection
 // state: 		current transaction state
 // buffer:		master buffer for client's command
 // messages:	messages in user's mailbox
-void handle_list(int comm_fd, int* state, char* buffer, vector< Message >& messages) {
+Task< bool > handle_list(Connection& conn, int* state, char* buffer, MessageList& messages) {
 	if (*state != TRANSACTION) {
-		write_response(comm_fd, BAD_SEQUENCE);
+		write_response(conn.out, BAD_SEQUENCE);
 	} else {
-		char command[COMMAND_LEN];
+		char command[MAILBOX_LEN];
 		copy_command(command, buffer);
 		if (strlen(command) == 0) {
-			list_all(comm_fd, messages);
+			co_return co_await list_all(conn, messages);
 		} else {
-			list_one(comm_fd, command, messages);
+			list_one(conn.out, command, messages);
 		}
 	}
+	co_return true;
 }
 
 // Handler for UIDL command. Checks whether the transaction is at the correct state and send response
 // accordingly. Checks if UIDL is followed by an argument and calls a corresponding helper function.
-// comm_fd: 	client's socket
+// conn:			client's connection
 // state: 		current transaction state
 // buffer:		master buffer for client's command
 // messages:	messages in user's mailbox
-void handle_uidl(int comm_fd, int* state, char* buffer, vector< Message >& messages) {
+Task< bool > handle_uidl(Connection& conn, int* state, char* buffer, MessageList& messages) {
 	if (*state != TRANSACTION) {
-		write_response(comm_fd, BAD_SEQUENCE);
+		write_response(conn.out, BAD_SEQUENCE);
 	} else {
-		char command[COMMAND_LEN];
+		char command[MAILBOX_LEN];
 		copy_command(command, buffer);
 		if (strlen(command) == 0) {
-			uidl_all(comm_fd, messages);
+			co_return co_await uidl_all(conn, messages);
 		} else {
-			uidl_one(comm_fd, command, messages);
+			uidl_one(conn.out, command, messages);
 		}
 	}
+	co_return true;
 }
 
 // Handler for RETR command. Checks whether the transaction is at the correct state and send response
 // accordingly. Prints a message to client's console.
-// comm_fd: 	client's socket
+// conn:			client's connection
 // state: 		current transaction state
 // buffer:		master buffer for client's command
+// user:		user name
+// mbox_fd:		user's mailbox
 // messages:	messages in user's mailbox
-void handle_retr(int comm_fd, int* state, char* buffer, vector< Message >& messages) {
+Task< bool > handle_retr(Connection& conn, int* state, char* buffer, char* user, int mbox_fd, MessageList& messages) {
+	OutputBuffer& out = conn.out;
+	bool ok = true;
 	if (*state != TRANSACTION) {
-		write_response(comm_fd, BAD_SEQUENCE);
+		write_response(out, BAD_SEQUENCE);
 	} else {
-		char command[COMMAND_LEN];
+		char command[MAILBOX_LEN];
 		copy_command(command, buffer);
 
 		if (strlen(command) == 0) {
-			write_response(comm_fd, UNRECGONIZED_COMMAND);
+			write_response(out, UNRECGONIZED_COMMAND);
 		} else {
 			int index = atoi(command);
 
-			if (index < 1 || index > messages.size() || messages[index - 1].deleted) {
-				write_response(comm_fd, NO_MESSAGE);
+			if (index < 1 || index > messages.size() || messages.deleted(index - 1)) {
+				write_response(out, NO_MESSAGE);
 			} else {
-				string message = messages[index - 1].content;
-				string res = "+OK " + to_string(message.length()) + " octets\r\n";
-				write_response(comm_fd, res.c_str());
-
-				int i = 0;
-				while (i < message.length()) {
-					int end = message.find('\n', i);
-					string line = message.substr(i, end + 1 - i);
-					write_response(comm_fd, line.c_str());
-					i = end + 1;
+				const IndexRecord& entry = messages.entry(index - 1);
+				off_t offset;
+				int body_fd = open_body(mbox_fd, user, entry, &offset);
+
+				if (body_fd < 0) {
+					write_response(out, NO_MESSAGE);
+				} else {
+					// the status line waits in the buffer for the start of the message
+					string res = "+OK " + to_string(entry.size) + " octets\r\n";
+					write_response(out, res.c_str());
+
+					ok = co_await send_message(conn, body_fd, offset, entry.size, entry.flags & INDEX_DOTS);
+					if (body_fd != mbox_fd) {
+						close(body_fd);
+					}
 				}
+			}
+		}
+	}
+	co_return ok;
+}
 
-				write_response(comm_fd, ".\r\n");
+// Handler for TOP command. Checks whether the transaction is at the correct state and send response
+// accordingly. Sends the headers of a message and the first lines of its body, reading only those bytes.
+// conn:			client's connection
+// state: 		current transaction state
+// buffer:		master buffer for client's command
+// user:		user name
+// mbox_fd:		user's mailbox
+// messages:	messages in user's mailbox
+Task< bool > handle_top(Connection& conn, int* state, char* buffer, char* user, int mbox_fd, MessageList& messages) {
+	OutputBuffer& out = conn.out;
+	bool ok = true;
+	if (*state != TRANSACTION) {
+		write_response(out, BAD_SEQUENCE);
+	} else {
+		char command[MAILBOX_LEN];
+		copy_command(command, buffer);
+
+		int index;
+		int lines;
+		if (sscanf(command, "%d %d", &index, &lines) != 2 || lines < 0) {
+			write_response(out, UNRECGONIZED_COMMAND);
+		} else if (index < 1 || index > messages.size() || messages.deleted(index - 1)) {
+			write_response(out, NO_MESSAGE);
+		} else {
+			const IndexRecord& entry = messages.entry(index - 1);
+			off_t offset;
+			int body_fd = open_body(mbox_fd, user, entry, &offset);
+
+			if (body_fd < 0) {
+				write_response(out, NO_MESSAGE);
+			} else {
+				write_response(out, TOP_FOLLOWS);
+
+				off_t len = top_length(body_fd, offset, entry, lines);
+				ok = co_await send_message(conn, body_fd, offset, len, entry.flags & INDEX_DOTS);
+				if (body_fd != mbox_fd) {
+					close(body_fd);
+				}
 			}
 		}
 	}
+	co_return ok;
+}
+
+// Handler for CAPA command (RFC 2449). Lists the optional commands supported, in any state.
+// out:			client's output buffer
+void handle_capa(OutputBuffer& out) {
+	write_response(out, CAPABILITIES);
 }
 
 // Handler for DELE command. Checks whether the transaction is at the correct state and send response
 // accordingly. Mark a message as deleted.
-// comm_fd: 	client's socket
+// out:			client's output buffer
 // state: 		current transaction state
 // buffer:		master buffer for client's command
 // messages:	messages in user's mailbox
-void handle_dele(int comm_fd, int* state, char* buffer, vector< Message >& messages) {
+void handle_dele(OutputBuffer& out, int* state, char* buffer, MessageList& messages) {
 	if (*state != TRANSACTION) {
-		write_response(comm_fd, BAD_SEQUENCE);
+		write_response(out, BAD_SEQUENCE);
 	} else {
-		char command[COMMAND_LEN];
+		char command[MAILBOX_LEN];
 		copy_command(command, buffer);
 
 		if (strlen(command) == 0) {
-			write_response(comm_fd, UNRECGONIZED_COMMAND);
+			write_response(out, UNRECGONIZED_COMMAND);
 		} else {
 			int index = atoi(command);
 
-			if (index < 1 || index > messages.size() || messages[index - 1].deleted) {
-				write_response(comm_fd, NO_MESSAGE);
+			if (index < 1 || index > messages.size() || messages.deleted(index - 1)) {
+				write_response(out, NO_MESSAGE);
 			} else {
-				messages[index - 1].deleted = true;
-				write_response(comm_fd, DELETED);
+				messages.remove(index - 1);
+				write_response(out, DELETED);
 			}
 		}
 	}
@@ -483,108 +960,65 @@ void handle_dele(int comm_fd, int* state, char* buffer, vector< Message >& messa
 
 // Handler for NOOP command. Checks whether the transaction is at the correct state and send response
 // accordingly.
-// comm_fd: 	client's socket
+// out:			client's output buffer
 // state:		current transaction state
-void handle_noop(int comm_fd, int* state) {
+void handle_noop(OutputBuffer& out, int* state) {
 	if (*state != TRANSACTION) {
-		write_response(comm_fd, BAD_SEQUENCE);
+		write_response(out, BAD_SEQUENCE);
 	} else {
-		write_response(comm_fd, "+OK\r\n");
+		write_response(out, "+OK\r\n");
 	}
 }
 
 // Handler for RSET command. Checks whether the transaction is at the correct state and send response
 // accordingly. Undo all DELE operations.
-// comm_fd: 	client's socket
+// out:			client's output buffer
 // state: 		current transaction state
 // messages:	messages in user's mailbox
-void handle_rset(int comm_fd, int* state, vector< Message >& messages) {
+void handle_rset(OutputBuffer& out, int* state, MessageList& messages) {
 	if (*state != TRANSACTION) {
-		write_response(comm_fd, BAD_SEQUENCE);
+		write_response(out, BAD_SEQUENCE);
 	} else {
-		for (int i = 0; i < messages.size(); i++) {
-			if (messages[i].deleted) {
-				messages[i].deleted = false;
-			}
-		}
-		write_response(comm_fd, RESET);
+		messages.restore();
+		write_response(out, RESET);
 	}
 }
 
 // Handler for QUIT command. Sets quit flag to true. Enters update state and deletes the messages marked as
 // deleted.
-// comm_fd: 	client's socket
+// out:			client's output buffer
 // state: 		current transaction state
 // user:		user name
 // messages:	messages in user's mailbox
 // quit:		true if the client writes QUIT
-void handle_quit(int comm_fd, int* state, char* user, vector< Message >& messages, bool* quit) {
+void handle_quit(OutputBuffer& out, int* state, char* user, MessageList& messages, bool* quit) {
 	// if client quits in authorization state, do not delete messages
 	if (*state == AUTHORIZATION) {
 		*quit = true;
-		write_response(comm_fd, QUIT);
+		write_response(out, QUIT);
 	} else if (*state == TRANSACTION) {
-		unordered_set< int > deletes;
-		for (int i = 0; i < messages.size(); i++) {
-			if (messages[i].deleted) {
-				deletes.insert(i);
-			}
-		}
-
-		// create a new file and replace the old one with it
-		string old_file = string(PARENTDIR) + "/" + string(user) + ".mbox";
-		ifstream mbox(old_file);
-		string new_file = string(PARENTDIR) + "/" + string(user) + ".mbox.new";
-		ofstream out(new_file);
-
-		string line;
-		string prefix = "From ";
-		bool to_delete = false;
-		int i = 0;
-		while (getline(mbox, line)) {
-			if (line.compare(0, prefix.size(), prefix) == 0) {
-				if (deletes.find(i) != deletes.end()) {
-					to_delete = true;
-				} else {
-					to_delete = false;
-					line += "\r";
-				}
-				i++;
-			}
-
-			if (!to_delete) {
-				out << line << "\n";
-			}
-		}
-		mbox.close();
-		out.close();
-
-		if (out) {
-			remove(old_file.c_str());
-			rename(new_file.c_str(), old_file.c_str());
-		}
+		expunge(user, messages);
 
 		*state = UPDATE;
 		*quit = true;
-		write_response(comm_fd, QUIT);
+		write_response(out, QUIT);
 	} else {
-		write_response(comm_fd, BAD_SEQUENCE);
+		write_response(out, BAD_SEQUENCE);
 	}
 }
 
-// Writes a response to client. Prints debug info to server's console.
-// comm_fd:		client's socket
+// Queues a response to client in its output buffer. Prints debug info to server's console.
+// out:			client's output buffer
 // response:	response to write to client
-void write_response(int comm_fd, const char* response) {
-	write(comm_fd, response, strlen(response));
+void write_response(OutputBuffer& out, const char* response) {
+	out.append(response, strlen(response));
 	if (DEBUG) {
-		fprintf(stderr, "[%d] S: %s", comm_fd, response);
+		fprintf(stderr, "[%d] S: %s", out.socket(), response);
 	}
 }
 
-// Parse recipient's email and host name from src and copy to rcpt and host.
-// rcpt: 	buffer for recipient's email address
-// host: 	buffer for host name
+// Copies the argument of a command from src to dest, truncated to MAILBOX_LEN - 1 characters.
+// dest: 	buffer for the argument, MAILBOX_LEN bytes
 // src:		source buffer
 void copy_command(char* dest, char* src) {
 	int i = 0;
@@ -601,7 +1035,7 @@ void copy_command(char* dest, char* src) {
 
 	i++;
 	int j = 0;
-	while (src[i] != '\r') {
+	while (src[i] != '\r' && j < MAILBOX_LEN - 1) {
 		dest[j] = src[i];
 		i++;
 		j++;
@@ -609,173 +1043,729 @@ void copy_command(char* dest, char* src) {
 	dest[j] = '\0';
 }
 
-// Parses mails from a .mbox file.
-// messages:	container for Message objects
+// Records the messages deleted in this session as tombstones in the mailbox's index, and drops the mailbox's
+// links to their bodies in the shared store. The mailbox itself is left alone, so this costs a few small writes
+// whatever its size; the compactor reclaims the space once dead messages make up COMPACT_RATIO of it. The
+// session's messages and the index are both in mailbox order, so a message is found in one pass by offset and
+// unique id; any not found that way, because the mailbox was compacted meanwhile, by unique id alone.
+// user:		user name
+// messages:	messages in user's mailbox
+void expunge(char* user, MessageList& messages) {
+	bool any = false;
+	for (int i = 0; i < messages.size() && !any; i++) {
+		any = messages.deleted(i);
+	}
+	if (!any) {
+		return;
+	}
+
+	string path = string(PARENTDIR) + "/" + string(user) + ".mbox";
+	int mbox_fd = mailbox_lock(path, O_RDONLY, LOCK_EX);
+	if (mbox_fd < 0) {
+		return;
+	}
+	CACHE.invalidate(user);
+
+	IndexReader index;
+	IndexHeader header;
+	int index_fd = current_index(mbox_fd, user, O_RDWR);
+	if (index_fd >= 0 && !index.open(index_fd, &header)) {
+		close(index_fd);
+	}
+
+	unordered_map< string, int > missing;
+	int64_t next = 0;
+	for (int i = 0; i < messages.size(); i++) {
+		if (!messages.deleted(i)) {
+			continue;
+		}
+
+		IndexRecord deleted = messages.entry(i);
+		while (next < index.size() && index.record(next).offset < deleted.offset) {
+			next++;
+		}
+		if (next < index.size() && index.record(next).offset == deleted.offset
+			&& !(index.record(next).flags & INDEX_DELETED) && strcmp(index.record(next).uid, deleted.uid) == 0) {
+			add_tombstone(index, next, mbox_fd, user);
+		} else {
+			missing[deleted.uid]++;
+		}
+	}
+	for (int64_t i = 0; !missing.empty() && i < index.size(); i++) {
+		if (index.record(i).flags & INDEX_DELETED) {
+			continue;
+		}
+		unordered_map< string, int >::iterator it = missing.find(index.record(i).uid);
+		if (it != missing.end()) {
+			if (--it->second == 0) {
+				missing.erase(it);
+			}
+			add_tombstone(index, i, mbox_fd, user);
+		}
+	}
+
+	struct stat st;
+	fstat(mbox_fd, &st);
+	bool compact = dead_bytes(index) >= COMPACT_RATIO * st.st_size;
+	index.close();
+	flock(mbox_fd, LOCK_UN);
+	close(mbox_fd);
+
+	if (compact) {
+		pthread_mutex_lock(&COMPACTIONS.lock);
+		COMPACTIONS.users.insert(string(user));
+		pthread_mutex_unlock(&COMPACTIONS.lock);
+		pthread_cond_signal(&COMPACTIONS.not_empty);
+	}
+}
+
+// Marks a message of the index as deleted, and drops the mailbox's link to its body in the shared store.
+// index:		index of the mailbox, open for writing
+// i:			position of the message in the index
+// mbox_fd:		user's mailbox
+// user:		user name
+void add_tombstone(IndexReader& index, int64_t i, int mbox_fd, char* user) {
+	IndexRecord record = index.record(i);
+	record.flags |= INDEX_DELETED;
+	if (index.update(i, record) && (record.flags & INDEX_STORED)) {
+		unlink(store_path(mbox_fd, record, user).c_str());
+	}
+}
+
+// Compactor thread. Rewrites the mailboxes queued by expunge() one after another.
+// arg: queue of mailboxes to compact.
+void* compactor(void* arg) {
+	CompactQueue* queue = (CompactQueue*)arg;
+
+	while (true) {
+		pthread_mutex_lock(&queue->lock);
+		while (queue->users.empty()) {
+			pthread_cond_wait(&queue->not_empty, &queue->lock);
+		}
+		string user = *queue->users.begin();
+		queue->users.erase(queue->users.begin());
+		pthread_mutex_unlock(&queue->lock);
+
+		compact(user);
+	}
+
+	pthread_exit(NULL);
+}
+
+// Copies the live messages of a mailbox, including any delivered since the deletions, to a new mailbox that
+// replaces the old one, along with a new index. Does nothing if the mailbox no longer needs it. Sessions that
+// have the old mailbox open keep reading from it. The new mailbox is synced before it replaces the old one,
+// and stays locked until its index is in place. Both indexes are streamed, whatever the mailbox's size.
+// user:		user name
+void compact(const string& user) {
+	string old_file = string(PARENTDIR) + "/" + user + ".mbox";
+	string new_file = old_file + ".new";
+	int mbox_fd = mailbox_lock(old_file, O_RDONLY, LOCK_EX);
+	if (mbox_fd < 0) {
+		return;
+	}
+	CACHE.invalidate(user);
+
+	IndexReader index;
+	IndexHeader header;
+	int index_fd = current_index(mbox_fd, (char*)user.c_str(), O_RDONLY);
+	if (index_fd >= 0 && !index.open(index_fd, &header)) {
+		close(index_fd);
+	}
+
+	struct stat st;
+	fstat(mbox_fd, &st);
+	off_t dead = dead_bytes(index);
+	if (dead == 0 || dead < COMPACT_RATIO * st.st_size) {
+		flock(mbox_fd, LOCK_UN);
+		close(mbox_fd);
+		return;
+	}
+
+	// create a new file and replace the old one with it
+	IndexWriter kept;
+	int out = open(new_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	bool ok = out >= 0 && flock(out, LOCK_EX) == 0 && kept.open(old_file + INDEX_SUFFIX);
+	off_t size = 0;
+	for (int64_t i = 0; ok && i < index.size(); i++) {
+		IndexRecord record = index.record(i);
+		if (record.flags & INDEX_DELETED) {
+			continue;
+		}
+
+		off_t offset = record.offset;
+		off_t end = offset + record.length;
+		while (ok && offset < end) {
+			ssize_t slen = sendfile(out, mbox_fd, &offset, end - offset);
+			ok = slen > 0;
+		}
+		record.offset = size;
+		size += record.length;
+		kept.add(record);
+	}
+	ok = ok && fsync(out) == 0;
+
+	if (ok && rename(new_file.c_str(), old_file.c_str()) == 0) {
+		kept.commit(size, UID_SCHEME);
+	} else {
+		unlink(new_file.c_str());
+	}
+	if (out >= 0) {
+		close(out);
+	}
+
+	flock(mbox_fd, LOCK_UN);
+	close(mbox_fd);
+}
+
+// Returns the bytes taken by deleted messages in a mailbox.
+// index:		index of the mailbox
+off_t dead_bytes(IndexReader& index) {
+	off_t dead = 0;
+	for (int64_t i = 0; i < index.size(); i++) {
+		if (index.record(i).flags & INDEX_DELETED) {
+			dead += index.record(i).length;
+		}
+	}
+	return dead;
+}
+
+// Opens a user's mailbox and lists its messages from the index, without reading any message. Returns the open
+// mailbox, which keeps serving the session's reads even if the file is replaced, or -1 if it cannot be opened.
+// A mailbox that has not changed since it was last read is served from the cache, without taking its lock.
+// A mailbox of more than SNAPSHOT_LIMIT messages is neither copied nor cached; the session reads its index.
+// messages:	set to the messages of the mailbox
 // src:			user name of the .mbox file
-void read_file(vector< Message >& messages, char* src) {
+int read_file(MessageList& messages, char* src) {
 	string mailbox = string(PARENTDIR) + "/" + string(src) + ".mbox";
-	ifstream mbox(mailbox);
-
-	string message;
-	string line;
-	string prefix = "From ";
-	while (getline(mbox, line)) {
-		if (line.compare(0, prefix.size(), prefix) == 0) {
-			Message m(message);
-			messages.push_back(m);
-			message = "";
+	string index_path = mailbox + INDEX_SUFFIX;
+	MailboxGeneration generation;
+	int mbox_fd = open(mailbox.c_str(), O_RDONLY);
+	if (mbox_fd >= 0 && mailbox_generation(mbox_fd, index_path, &generation)) {
+		shared_ptr< const MailboxSnapshot > cached = CACHE.find(src, generation);
+		if (cached) {
+			messages.open(cached);
+			return mbox_fd;
+		}
+	}
+	if (mbox_fd >= 0) {
+		close(mbox_fd);
+	}
+
+	int index_fd;
+	while (true) {
+		mbox_fd = mailbox_lock(mailbox, O_RDONLY, LOCK_SH);
+		if (mbox_fd < 0) {
+			return -1;
+		}
+		index_fd = open_index(mbox_fd, src, O_RDONLY);
+		if (index_fd >= 0) {
+			break;
+		}
+
+		// a stale index is rebuilt under the exclusive lock, and only if nobody rebuilt it in the meantime; if
+		// the mailbox was compacted while the lock was dropped, start over with the new one
+		flock(mbox_fd, LOCK_EX);
+		if (mailbox_current(mbox_fd, mailbox)) {
+			index_fd = current_index(mbox_fd, src, O_RDONLY);
+			break;
+		}
+		close(mbox_fd);
+	}
+
+	vector< IndexRecord > records;
+	IndexHeader header;
+	int64_t count = 0;
+	if (index_header(index_fd, &header, &count) && count > SNAPSHOT_LIMIT) {
+		messages.open(index_fd);
+		flock(mbox_fd, LOCK_UN);
+		return mbox_fd;
+	}
+	if (index_fd >= 0) {
+		index_read(index_fd, records, &header);
+		close(index_fd);
+	}
+
+	shared_ptr< MailboxSnapshot > snapshot = make_shared< MailboxSnapshot >();
+	int live = 0;
+	for (int i = 0; i < records.size(); i++) {
+		live += !(records[i].flags & INDEX_DELETED);
+	}
+	snapshot->records.reserve(live);
+	for (int i = 0; i < records.size(); i++) {
+		if (!(records[i].flags & INDEX_DELETED)) {
+			snapshot->records.push_back(records[i]);
+		}
+	}
+	if (index_fd >= 0 && mailbox_generation(mbox_fd, index_path, &snapshot->generation)) {
+		CACHE.insert(src, snapshot);
+	}
+	flock(mbox_fd, LOCK_UN);
+
+	messages.open(snapshot);
+	return mbox_fd;
+}
+
+// Opens the index of a mailbox. Returns -1 if it is missing, damaged or stale. The caller holds the mailbox's
+// lock.
+// mbox_fd:		user's mailbox
+// user:		user name of the .mbox file
+// flags:		O_RDONLY, or O_RDWR to add tombstones
+int open_index(int mbox_fd, char* user, int flags) {
+	struct stat st;
+	fstat(mbox_fd, &st);
+
+	string path = string(PARENTDIR) + "/" + string(user) + ".mbox" + INDEX_SUFFIX;
+	int index_fd = open(path.c_str(), flags);
+	IndexHeader header;
+	int64_t count;
+	if (index_fd >= 0 && (!index_header(index_fd, &header, &count) || header.mbox_size != st.st_size
+		|| header.scheme != UID_SCHEME)) {
+		close(index_fd);
+		index_fd = -1;
+	}
+	return index_fd;
+}
+
+// Opens the index of a mailbox, rebuilding it first if it is stale. Returns -1 if it cannot be rebuilt. The
+// caller holds the mailbox's lock exclusively.
+// mbox_fd:		user's mailbox
+// user:		user name of the .mbox file
+// flags:		O_RDONLY, or O_RDWR to add tombstones
+int current_index(int mbox_fd, char* user, int flags) {
+	int index_fd = open_index(mbox_fd, user, flags);
+	if (index_fd < 0) {
+		rebuild_index(mbox_fd, user);
+		index_fd = open_index(mbox_fd, user, flags);
+	}
+	return index_fd;
+}
+
+// Rebuilds the index of a mailbox by scanning it for "From " lines, and writes it out. This reads every
+// message once, to size it and compute its unique id, spread over the hash helpers. Messages are finished and
+// written out REBUILD_BATCH at a time, so a mailbox of any size is rebuilt in bounded memory. Deletions are
+// only recorded in the index, so they are carried over from the stale one. The caller holds the mailbox's lock
+// exclusively.
+// mbox_fd:		user's mailbox
+// user:		user name of the .mbox file
+void rebuild_index(int mbox_fd, char* user) {
+	FILE* mbox = fdopen(dup(mbox_fd), "r");
+	if (mbox == NULL) {
+		return;
+	}
+
+	string index_path = string(PARENTDIR) + "/" + string(user) + ".mbox" + INDEX_SUFFIX;
+	IndexRebuild rebuild;
+	rebuild.mbox_fd = mbox_fd;
+	rebuild.user = user;
+	rebuild.stale_next = 0;
+	IndexHeader stale_header;
+	int stale_fd = open(index_path.c_str(), O_RDONLY);
+	if (stale_fd >= 0 && !rebuild.stale.open(stale_fd, &stale_header)) {
+		close(stale_fd);
+	}
+	rebuild.same_scheme = rebuild.stale.size() > 0 && stale_header.scheme == UID_SCHEME;
+	if (!rebuild.index.open(index_path)) {
+		fclose(mbox);
+		return;
+	}
+
+	// where each message starts and where its body starts
+	vector< IndexRecord >& records = rebuild.records;
+	char* line = NULL;
+	size_t capacity = 0;
+	ssize_t len;
+	off_t offset = 0;
+	bool header = false;
+	while ((len = getline(&line, &capacity, mbox)) > 0) {
+		if (strncmp(line, "From ", 5) == 0) {
+			if (!records.empty()) {
+				records.back().length = offset - records.back().offset;
+				if (records.size() == REBUILD_BATCH) {
+					rebuild_batch(&rebuild);
+				}
+			}
+			IndexRecord record;
+			memset(&record, 0, sizeof(record));
+			record.offset = offset;
+			records.push_back(record);
+			rebuild.bodies.push_back(offset + len);
+			header = true;
+		} else if (header && strncmp(line, STORE_REF, strlen(STORE_REF)) == 0) {
+			records.back().flags |= INDEX_STORED;
+			header = false;
 		} else {
-			message += line;
-			// end a line properly
-			message.pop_back();
-			message += "\r\n";
+			header = false;
 		}
+		offset += len;
+	}
+	if (!records.empty()) {
+		records.back().length = offset - records.back().offset;
 	}
-	mbox.close();
+	rebuild_batch(&rebuild);
+	free(line);
+	fclose(mbox);
 
-	// erase first message, which is empty, and append the last message.
-	if (messages.size() > 0) {
-		messages.erase(messages.begin());
-		messages.push_back(Message(message));
+	rebuild.index.commit(offset, UID_SCHEME);
+}
+
+// Finishes a batch of messages found by rebuild_index() and adds them to the new index: sizes and unique ids,
+// from the shared store for stored bodies, and deletions carried over from the stale index. A deletion is
+// matched by offset and unique id, or by offset and length if the unique ids changed scheme; both indexes are
+// in mailbox order, so the stale one is read alongside.
+// rebuild:		index being rebuilt
+void rebuild_batch(IndexRebuild* rebuild) {
+	vector< IndexRecord >& records = rebuild->records;
+	HashBatch batch;
+	batch.records = &records;
+	batch.next = 0;
+	batch.unfinished = records.size();
+	for (int i = 0; i < records.size(); i++) {
+		if (records[i].flags & INDEX_STORED) {
+			int body_fd = open(store_path(rebuild->mbox_fd, records[i], rebuild->user).c_str(), O_RDONLY);
+			struct stat st;
+			if (body_fd >= 0 && fstat(body_fd, &st) == 0) {
+				records[i].size = st.st_size;
+			}
+			batch.fds.push_back(body_fd);
+			batch.offsets.push_back(0);
+		} else {
+			records[i].size = records[i].offset + records[i].length - rebuild->bodies[i];
+			batch.fds.push_back(rebuild->mbox_fd);
+			batch.offsets.push_back(rebuild->bodies[i]);
+		}
+	}
+	hash_batch(&HASHERS, &batch);
+	for (int i = 0; i < records.size(); i++) {
+		if (batch.fds[i] >= 0 && batch.fds[i] != rebuild->mbox_fd) {
+			close(batch.fds[i]);
+		}
+	}
+
+	IndexReader& stale = rebuild->stale;
+	for (int i = 0; i < records.size(); i++) {
+		while (rebuild->stale_next < stale.size() && stale.record(rebuild->stale_next).offset < records[i].offset) {
+			rebuild->stale_next++;
+		}
+		if (rebuild->stale_next < stale.size()) {
+			const IndexRecord& old = stale.record(rebuild->stale_next);
+			if (old.offset == records[i].offset && (old.flags & INDEX_DELETED) && (rebuild->same_scheme
+				? strcmp(old.uid, records[i].uid) == 0 : old.length == records[i].length)) {
+				records[i].flags |= INDEX_DELETED;
+			}
+		}
+		rebuild->index.add(records[i]);
 	}
+
+	records.clear();
+	rebuild->bodies.clear();
 }
 
-// List all messages' indexes and sizes
-// comm_fd:		client's socket
+// Hash helper thread. Takes messages from the batches of index rebuilds in progress.
+// arg: the pool of hash helpers.
+void* hash_helper(void* arg) {
+	HashPool* pool = (HashPool*)arg;
+
+	pthread_mutex_lock(&pool->lock);
+	while (true) {
+		while (pool->batches.empty()) {
+			pthread_cond_wait(&pool->not_empty, &pool->lock);
+		}
+		HashBatch* batch = pool->batches.front();
+		int i = claim_message(pool, batch);
+		pthread_mutex_unlock(&pool->lock);
+
+		hash_message(batch, i);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--batch->unfinished == 0) {
+			pthread_cond_broadcast(&pool->done);
+		}
+	}
+
+	pthread_exit(NULL);
+}
+
+// Computes the unique ids of a batch of messages. The calling thread hashes messages alongside the helpers and
+// returns once every message is done.
+// pool:	the pool of hash helpers
+// batch:	messages to hash
+void hash_batch(HashPool* pool, HashBatch* batch) {
+	if (batch->unfinished == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->batches.push_back(batch);
+	pthread_cond_broadcast(&pool->not_empty);
+	while (batch->next < batch->fds.size()) {
+		int i = claim_message(pool, batch);
+		pthread_mutex_unlock(&pool->lock);
+
+		hash_message(batch, i);
+
+		pthread_mutex_lock(&pool->lock);
+		batch->unfinished--;
+	}
+	while (batch->unfinished > 0) {
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// Takes the next message of a batch, and takes the batch off the pool once it has none left. Called with the
+// pool's lock held.
+// pool:	the pool of hash helpers
+// batch:	batch with at least one message left
+int claim_message(HashPool* pool, HashBatch* batch) {
+	int i = batch->next++;
+	if (batch->next == batch->fds.size()) {
+		pool->batches.erase(find(pool->batches.begin(), pool->batches.end(), batch));
+	}
+	return i;
+}
+
+// Fills in the unique id, header length and INDEX_DOTS of one message of a batch.
+// batch:	batch of the message
+// i:		position of the message in the batch
+void hash_message(HashBatch* batch, int i) {
+	IndexRecord& record = (*batch->records)[i];
+	if (batch->fds[i] >= 0) {
+		index_content(batch->fds[i], batch->offsets[i], record.size, UID_SCHEME, record);
+	}
+}
+
+// Returns the file holding a message's content: the mailbox itself, or the message's body in the shared store,
+// which the caller closes. Returns -1 if the body cannot be opened.
+// mbox_fd:		user's mailbox
+// user:		user name of the .mbox file
+// entry:		index record of the message to open
+// offset:		set to the start of the content in the file
+int open_body(int mbox_fd, char* user, const IndexRecord& entry, off_t* offset) {
+	if (!(entry.flags & INDEX_STORED)) {
+		*offset = entry.offset + entry.length - entry.size;
+		return mbox_fd;
+	}
+
+	*offset = 0;
+	return open(store_path(mbox_fd, entry, user).c_str(), O_RDONLY);
+}
+
+// Returns how much of a message TOP sends: the headers and the blank line from the index, then the given number
+// of body lines, which are the only bytes read.
+// body_fd:		file holding the content
+// offset:		start of the content in the file
+// entry:		index record of the message
+// lines:		number of body lines to send
+off_t top_length(int body_fd, off_t offset, const IndexRecord& entry, int lines) {
+	off_t len = entry.header;
+	char buffer[TOP_CHUNK];
+	while (lines > 0 && len < entry.size) {
+		ssize_t rlen = pread(body_fd, buffer, min((off_t)TOP_CHUNK, (off_t)entry.size - len), offset + len);
+		if (rlen <= 0) {
+			break;
+		}
+
+		char* p = buffer;
+		char* end = buffer + rlen;
+		while (lines > 0 && (p = find_byte(p, end, '\n')) != NULL) {
+			p++;
+			lines--;
+		}
+		len += lines > 0 ? rlen : p - buffer;
+	}
+	return len;
+}
+
+// Sends a message as the body of a multi-line response, followed by the terminating line. A message with no
+// line starting with '.' goes from the file to the socket with sendfile(). Any other message is mapped
+// MAP_WINDOW bytes at a time and sent with writev() in batches of IOV_BATCH pieces, with a '.' in front of each
+// such line (RFC 1939 byte-stuffing).
+// The socket is corked meanwhile, so the buffered status line leaves with the start of the message and the
+// terminating line with its end. Returns false if the connection is broken.
+// conn:		client's connection
+// body_fd:		file holding the content
+// offset:		start of the content in the file
+// len:			length of the content
+// stuff:		true if some line starts with '.'
+Task< bool > send_message(Connection& conn, int body_fd, off_t offset, off_t len, bool stuff) {
+	// the terminating line must start on a line of its own
+	char tail[2] = { '\r', '\n' };
+	if (len >= 2) {
+		pread(body_fd, tail, 2, offset + len - 2);
+	}
+	const char* terminator = tail[0] == '\r' && tail[1] == '\n' ? ".\r\n" : "\r\n.\r\n";
+
+	int comm_fd = conn.fd;
+	int cork = 1;
+	setsockopt(comm_fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+	bool ok = co_await conn.flush(true);
+	if (!stuff) {
+		ok = ok && co_await conn.send_file(body_fd, &offset, len);
+	} else {
+		bool line_start = true;
+		while (ok && len > 0) {
+			off_t start = offset - offset % sysconf(_SC_PAGESIZE);
+			off_t piece = min(len, (off_t)MAP_WINDOW);
+			size_t map_len = piece + (offset - start);
+			char* map = (char*)mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, body_fd, start);
+			ok = map != MAP_FAILED;
+			if (ok) {
+				madvise(map, map_len, MADV_SEQUENTIAL);
+				ok = co_await send_stuffed(conn, map + (offset - start), piece, line_start);
+				line_start = map[map_len - 1] == '\n';
+				munmap(map, map_len);
+			}
+			offset += piece;
+			len -= piece;
+		}
+	}
+
+	ok = ok && conn.out.append(terminator, strlen(terminator)) && co_await conn.flush(false);
+	cork = 0;
+	setsockopt(comm_fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+	if (DEBUG) fprintf(stderr, "[%d] S: .\r\n", comm_fd);
+	co_return ok;
+}
+
+// Writes mapped content to the socket with a '.' in front of each line that starts with one. Returns false if
+// the connection is broken.
+// conn:		client's connection
+// piece:		mapped content
+// len:			length of the content
+// line_start:	true if the content starts a line, rather than continuing the previous piece's last line
+Task< bool > send_stuffed(Connection& conn, char* piece, off_t len, bool line_start) {
+	static char dot[] = ".";
+	char* end = piece + len;
+	char* p = piece;
+	struct iovec iov[IOV_BATCH];
+	int count = 0;
+	bool ok = true;
+
+	if (line_start && *p == '.') {
+		iov[count].iov_base = dot;
+		iov[count++].iov_len = 1;
+	}
+	while (ok && (p = find_byte(p, end, '\n')) != NULL && ++p < end) {
+		if (*p != '.') {
+			continue;
+		}
+		iov[count].iov_base = piece;
+		iov[count++].iov_len = p - piece;
+		iov[count].iov_base = dot;
+		iov[count++].iov_len = 1;
+		piece = p;
+
+		if (count >= IOV_BATCH - 2) {
+			ok = co_await conn.send(iov, count);
+			count = 0;
+		}
+	}
+	iov[count].iov_base = piece;
+	iov[count++].iov_len = end - piece;
+	co_return ok && co_await conn.send(iov, count);
+}
+
+// Returns the path of a stored message's body in the shared store, from the reference line in the mailbox.
+// mbox_fd:		user's mailbox
+// entry:		index record of the message
+// user:		user name of the .mbox file
+string store_path(int mbox_fd, const IndexRecord& entry, char* user) {
+	string raw(entry.length, '\0');
+	pread(mbox_fd, &raw[0], raw.length(), entry.offset);
+
+	size_t ref = raw.find('\n') + 1 + strlen(STORE_REF);
+	string id = raw.substr(ref, raw.find('\r', ref) - ref);
+	return string(PARENTDIR) + "/.store/" + id + "." + string(user) + ".mbox";
+}
+
+// List all messages' indexes and sizes. The lines are formatted straight into the output buffer, which is
+// sent whenever the next line may not fit. Returns false if the connection is broken.
+// conn:			client's connection
 // messages:	messages in user's mailbox
-void list_all(int comm_fd, vector< Message >& messages) {
+Task< bool > list_all(Connection& conn, MessageList& messages) {
+	OutputBuffer& out = conn.out;
 	int count = 0;
-	int chars = 0;
-	vector< string > list;
+	int64_t chars = 0;
 	
 	for (int i = 0; i < messages.size(); i++) {
-		if (!messages[i].deleted) {
+		if (!messages.deleted(i)) {
 			count++;
-			int len = messages[i].content.length();
-			chars += len;
-			string line = to_string(i + 1) + " " + to_string(len) + "\r\n";
-			list.push_back(line);
+			chars += messages.entry(i).size;
 		}
 	}
 
 	string res = "+OK " + to_string(count) + " messages (" + to_string(chars) + " octets)\r\n";
-	write_response(comm_fd, res.c_str());
+	write_response(out, res.c_str());
 
-	for (int i = 0; i < list.size(); i++) {
-		write_response(comm_fd, list[i].c_str());
+	for (int i = 0; i < messages.size(); i++) {
+		if (!messages.deleted(i)) {
+			if (out.size() + LISTING_LINE > OUTPUT_SIZE && !co_await conn.flush(true)) {
+				co_return false;
+			}
+			char* line = out.space(LISTING_LINE);
+			int len = snprintf(line, LISTING_LINE, "%d %lld\r\n", i + 1, (long long)messages.entry(i).size);
+			if (DEBUG) fprintf(stderr, "[%d] S: %s", out.socket(), line);
+			out.produced(len);
+		}
 	}
 
-	write_response(comm_fd, ".\r\n");
+	write_response(out, ".\r\n");
+	co_return true;
 }
 
 // List index and size about one of the messages
-// comm_fd:		client's socket
+// out:			client's output buffer
 // command:		index of the message to list
 // messages:	messages in user's mailbox
-void list_one(int comm_fd, char* command, vector< Message >& messages) {
+void list_one(OutputBuffer& out, char* command, MessageList& messages) {
 	int index = atoi(command);
 
-	if (index < 1 || index > messages.size() || messages[index - 1].deleted) {
-		write_response(comm_fd, NO_MESSAGE);
+	if (index < 1 || index > messages.size() || messages.deleted(index - 1)) {
+		write_response(out, NO_MESSAGE);
 	} else {
-		int len = messages[index - 1].content.length();
+		int64_t len = messages.entry(index - 1).size;
 		string res = "+OK " + to_string(index) + " " + to_string(len) + "\r\n";
-		write_response(comm_fd, res.c_str());
+		write_response(out, res.c_str());
 	}
 }
 
-// List all messages' unique ids.
-// comm_fd:		client's socket
+// List all messages' unique ids. The ids were computed at delivery and are read from the index; the lines
+// are formatted straight into the output buffer, which is sent whenever the next line may not fit. Returns
+// false if the connection is broken.
+// conn:			client's connection
 // messages:	messages in user's mailbox
-void uidl_all(int comm_fd, vector< Message >& messages) {
-	write_response(comm_fd, UIDL_ALL);
+Task< bool > uidl_all(Connection& conn, MessageList& messages) {
+	OutputBuffer& out = conn.out;
+	write_response(out, UIDL_ALL);
 
 	for (int i = 0; i < messages.size(); i++) {
-		if (!messages[i].deleted) {
-			unsigned char* digest = (unsigned char*)malloc(sizeof(MD5_DIGEST_LENGTH));
-			char* uid = (char*)malloc(sizeof(MD5_DIGEST_LENGTH * 2));
-
-			char msg[messages[i].content.length() + 1];
-			const char* message = messages[i].content.c_str();
-			strcpy(msg, message);
-			
-			computeDigest(msg, strlen(msg), digest);
-			// convert digest to hex
-			for (int j = 0; j < MD5_DIGEST_LENGTH; j++) {
-				sprintf(uid + j, "%02x", digest[j]);
+		if (!messages.deleted(i)) {
+			if (out.size() + LISTING_LINE > OUTPUT_SIZE && !co_await conn.flush(true)) {
+				co_return false;
 			}
-
-			string res = to_string(i + 1) + " " + string(uid) + "\r\n";
-			write_response(comm_fd, res.c_str());
-
-			free(digest);
-			free(uid);
+			char* line = out.space(LISTING_LINE);
+			int len = snprintf(line, LISTING_LINE, "%d %s\r\n", i + 1, messages.entry(i).uid);
+			if (DEBUG) fprintf(stderr, "[%d] S: %s", out.socket(), line);
+			out.produced(len);
 		}
 	}
 
-	write_response(comm_fd, ".\r\n");
+	write_response(out, ".\r\n");
+	co_return true;
 }
 
 // List the unique id of one of the messages
-// comm_fd:		client's socket
+// out:			client's output buffer
 // command:		index of the message to list
 // messages:	messages in user's mailbox
-void uidl_one(int comm_fd, char* command, vector< Message >& messages) {
+void uidl_one(OutputBuffer& out, char* command, MessageList& messages) {
 	int index = atoi(command);
 
-	if (index < 1 || index > messages.size() || messages[index - 1].deleted) {
-		write_response(comm_fd, NO_MESSAGE);
+	if (index < 1 || index > messages.size() || messages.deleted(index - 1)) {
+		write_response(out, NO_MESSAGE);
 	} else {
-		unsigned char* digest = (unsigned char*)malloc(sizeof(MD5_DIGEST_LENGTH));
-		char* uid = (char*)malloc(sizeof(MD5_DIGEST_LENGTH * 2));
-		char msg[messages[index - 1].content.length() + 1];
-		
-		const char* message = messages[index - 1].content.c_str();
-		strcpy(msg, message);
-		
-		computeDigest(msg, strlen(msg), digest);
-		// convert digest to hex
-		for (int j = 0; j < MD5_DIGEST_LENGTH; j++) {
-			sprintf(uid + j, "%02x", digest[j]);
-		}
-
-		string res = "+OK " + to_string(index) + " " + string(uid) + "\r\n";
-		write_response(comm_fd, res.c_str());
-
-		free(digest);
-		free(uid);
-	}
-}
-
-// Compute the MD5 hash of a given string.
-// data:			input string
-// dataLengthBytes:	length of input string
-// digestBuffer:	result buffer
-void computeDigest(char *data, int dataLengthBytes, unsigned char *digestBuffer){
-	/* The digest will be written to digestBuffer, which must be at least MD5_DIGEST_LENGTH bytes long */
-
-	MD5_CTX c;
-	MD5_Init(&c);
-	MD5_Update(&c, data, dataLengthBytes);
-	MD5_Final(digestBuffer, &c);
-}
-
-// After worker thread has parsed a full command, this function clears the command from buffer, and moves
-// all remaining characters to the start of buffer.
-void remove_command(char* buf, char* end) {
-	char* curr = buf;
-
-	while (curr != end) {
-		*curr = '\0';
-		curr++;
-	}
-
-	curr = buf;
-
-	while (*end != '\0') {
-		*curr = *end;
-		*end = '\0';
-		curr++;
-		end++;
+		string res = "+OK " + to_string(index) + " " + messages.entry(index - 1).uid + "\r\n";
+		write_response(out, res.c_str());
 	}
 }
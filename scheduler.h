@@ -0,0 +1,331 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <coroutine>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+#include "linebuffer.h"
+
+// Sessions written as C++20 coroutines. A session reads as straight-line code, co_await conn.read_line() and
+// co_await conn.flush() included, and runs in one of two ways:
+//
+// - on a blocking socket, by its own thread. No I/O ever reports EAGAIN, so nothing suspends and the
+//   coroutine runs to the end the moment it is started;
+// - on a non-blocking socket, on a Scheduler. An operation that would block suspends the session until epoll
+//   reports the socket ready again, and meanwhile the scheduler's thread runs other sessions.
+//
+// A suspended session holds only its coroutine frames and buffers, not a thread and its stack. Each socket is
+// registered with epoll once, edge triggered, so waiting costs no epoll_ctl() calls.
+
+class Scheduler;
+
+// Result of a coroutine, handed to whoever co_awaits it. A task starts when it is awaited, or when it is
+// detached, and resumes its awaiter directly when it finishes.
+template < typename T >
+class Task {
+public:
+	struct promise_type;
+
+	// resumes the awaiter of a finished task; a detached task frees itself instead
+	struct FinalAwaiter {
+		bool await_ready() noexcept { return false; }
+		std::coroutine_handle<> await_suspend(std::coroutine_handle< promise_type > handle) noexcept {
+			std::coroutine_handle<> continuation = handle.promise().continuation;
+			if (continuation) {
+				return continuation;
+			}
+			handle.destroy();
+			return std::noop_coroutine();
+		}
+		void await_resume() noexcept {}
+	};
+
+	struct promise_type {
+		T value;
+		std::coroutine_handle<> continuation;
+
+		Task get_return_object() {
+			return Task(std::coroutine_handle< promise_type >::from_promise(*this));
+		}
+		std::suspend_always initial_suspend() noexcept { return std::suspend_always(); }
+		FinalAwaiter final_suspend() noexcept { return FinalAwaiter(); }
+		void return_value(T result) { value = result; }
+		void unhandled_exception() { abort(); }
+	};
+
+	Task(Task&& other): handle(other.handle) { other.handle = NULL; }
+	~Task() {
+		if (handle) {
+			handle.destroy();
+		}
+	}
+
+	bool await_ready() { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) {
+		handle.promise().continuation = awaiter;
+		return handle;
+	}
+	T await_resume() { return handle.promise().value; }
+
+	// Starts a task that nothing awaits, such as a whole session. It frees itself when it finishes.
+	void detach() {
+		std::coroutine_handle< promise_type > started = handle;
+		handle = NULL;
+		started.resume();
+	}
+
+private:
+	explicit Task(std::coroutine_handle< promise_type > handle): handle(handle) {}
+	Task(const Task&);
+	Task& operator=(const Task&);
+
+	std::coroutine_handle< promise_type > handle;
+};
+
+// One client connection of a session: its socket, the line buffer commands are read into and the output
+// buffer responses collect in. Without a scheduler the socket is blocking and no operation suspends.
+class Connection {
+public:
+	Connection(int fd, int in_capacity, int out_capacity, Scheduler* scheduler);
+
+	// waits until the socket reports one of the events, or an error
+	struct Wait {
+		Connection* conn;
+		uint32_t events;
+
+		bool await_ready() { return conn->scheduler == NULL; }
+		void await_suspend(std::coroutine_handle<> session) {
+			conn->waiting = session;
+			conn->wanted = events;
+		}
+		void await_resume() {}
+	};
+
+	Wait readable() {
+		return Wait{ this, EPOLLIN | EPOLLRDHUP };
+	}
+
+	Wait writable() {
+		return Wait{ this, EPOLLOUT };
+	}
+
+	// Returns the next complete command line, '\0'-terminated in place until in.consume(), or NULL once the
+	// client has closed the connection. Before waiting for more input, everything queued in the output buffer
+	// is sent, so the responses to a batch of pipelined commands leave together.
+	// len:	set to the length of the line
+	Task< char* > read_line(int* len) {
+		char* line;
+		while ((line = in.next_line(len)) == NULL) {
+			if (!co_await flush(false)) {
+				co_return NULL;
+			}
+
+			int space;
+			char* dest = in.space(&space);
+			ssize_t rlen = read(fd, dest, space);
+			if (rlen < 0 && errno == EINTR) {
+				continue;
+			}
+			if (rlen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				co_await readable();
+				continue;
+			}
+			if (rlen <= 0) {
+				co_return NULL;
+			}
+			in.produced(rlen);
+		}
+		co_return line;
+	}
+
+	// Sends the output buffer. Returns false if the connection is broken.
+	// more:	true if more output follows right away (MSG_MORE)
+	Task< bool > flush(bool more) {
+		while (out.flush(more)) {
+			if (out.size() == 0) {
+				co_return true;
+			}
+			co_await writable();
+		}
+		co_return false;
+	}
+
+	// Writes a batch of pieces around the output buffer, continuing after partial writes. Returns false if the
+	// connection is broken.
+	// iov:		pieces to write; modified
+	// count:	number of pieces
+	Task< bool > send(struct iovec* iov, int count) {
+		while (count > 0) {
+			ssize_t wlen = writev(fd, iov, count);
+			if (wlen < 0 && errno == EINTR) {
+				continue;
+			}
+			if (wlen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				co_await writable();
+				continue;
+			}
+			if (wlen <= 0) {
+				co_return false;
+			}
+
+			while (count > 0 && (size_t)wlen >= iov->iov_len) {
+				wlen -= iov->iov_len;
+				iov++;
+				count--;
+			}
+			if (count > 0) {
+				iov->iov_base = (char*)iov->iov_base + wlen;
+				iov->iov_len -= wlen;
+			}
+		}
+		co_return true;
+	}
+
+	// Sends part of a file with sendfile(). Returns false if the connection is broken.
+	// file_fd:	file to send from
+	// offset:	where to start; advanced past what was sent
+	// len:		number of bytes
+	Task< bool > send_file(int file_fd, off_t* offset, off_t len) {
+		while (len > 0) {
+			ssize_t slen = sendfile(fd, file_fd, offset, len);
+			if (slen < 0 && errno == EINTR) {
+				continue;
+			}
+			if (slen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				co_await writable();
+				continue;
+			}
+			if (slen <= 0) {
+				co_return false;
+			}
+			len -= slen;
+		}
+		co_return true;
+	}
+
+	// Resumes the session if it waits for one of the events. Called by the scheduler; the session may finish
+	// and free the connection before this returns.
+	// events:	epoll events of the socket
+	void wake(uint32_t events) {
+		if (waiting && (events & (wanted | EPOLLERR | EPOLLHUP))) {
+			std::coroutine_handle<> session = waiting;
+			waiting = NULL;
+			session.resume();
+		}
+	}
+
+	int fd;
+	LineBuffer in;
+	OutputBuffer out;
+
+private:
+	Connection(const Connection&);
+	Connection& operator=(const Connection&);
+
+	Scheduler* scheduler;
+	std::coroutine_handle<> waiting;
+	uint32_t wanted;
+};
+
+// Event loop that runs sessions on one thread. Connections are handed over from the accepting thread with
+// post(); the scheduler starts a session for each and resumes sessions as their sockets become ready.
+class Scheduler {
+public:
+	Scheduler(): epoll_fd(-1), wake_fd(-1) {
+		pthread_mutex_init(&lock, NULL);
+	}
+
+	// Creates the epoll instance. Returns false if it cannot.
+	bool start() {
+		epoll_fd = epoll_create1(0);
+		wake_fd = eventfd(0, EFD_NONBLOCK);
+		if (epoll_fd < 0 || wake_fd < 0) {
+			return false;
+		}
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.ptr = NULL;
+		return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) == 0;
+	}
+
+	// Hands an accepted, non-blocking socket to the scheduler. Called from any thread.
+	// fd:	client's socket
+	void post(int fd) {
+		pthread_mutex_lock(&lock);
+		incoming.push_back(fd);
+		pthread_mutex_unlock(&lock);
+		uint64_t one = 1;
+		write(wake_fd, &one, sizeof(one));
+	}
+
+	// Runs sessions forever on the calling thread.
+	// session:	starts the session of a connection
+	void run(Task< bool > (*session)(int fd, Scheduler* scheduler)) {
+		struct epoll_event events[256];
+		std::vector< int > accepted;
+
+		while (true) {
+			int n = epoll_wait(epoll_fd, events, 256, -1);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n < 0) {
+				break;
+			}
+
+			for (int i = 0; i < n; i++) {
+				if (events[i].data.ptr != NULL) {
+					((Connection*)events[i].data.ptr)->wake(events[i].events);
+					continue;
+				}
+
+				uint64_t count;
+				read(wake_fd, &count, sizeof(count));
+				pthread_mutex_lock(&lock);
+				accepted.swap(incoming);
+				pthread_mutex_unlock(&lock);
+				for (int j = 0; j < accepted.size(); j++) {
+					session(accepted[j], this).detach();
+				}
+				accepted.clear();
+			}
+		}
+	}
+
+	// Registers a connection's socket for every readiness change, once for its lifetime. Closing the socket
+	// unregisters it.
+	// conn:	connection of a session on this scheduler
+	void watch(Connection* conn) {
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.ptr = conn;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &event);
+	}
+
+private:
+	Scheduler(const Scheduler&);
+	Scheduler& operator=(const Scheduler&);
+
+	int epoll_fd;
+	int wake_fd;
+	std::vector< int > incoming;
+	pthread_mutex_t lock;
+};
+
+inline Connection::Connection(int fd, int in_capacity, int out_capacity, Scheduler* scheduler): fd(fd),
+	in(in_capacity), out(fd, out_capacity), scheduler(scheduler), waiting(NULL), wanted(0) {
+	if (scheduler != NULL) {
+		scheduler->watch(this);
+	}
+}
+
+#endif
@@ -1,19 +1,32 @@
 #include <arpa/inet.h>
 #include <ctime>
 #include <dirent.h>
-#include <fstream>
+#include <errno.h>
+#include <fcntl.h>
 #include <iostream>
 #include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <unordered_set>
 #include <vector>
 
+#include "ioring.h"
+#include "journal.h"
+#include "linebuffer.h"
+#include "mailboxes.h"
+#include "mboxindex.h"
+
 using namespace std;
 
 // constant strings
@@ -21,6 +34,7 @@ const char* NEW_CONN 			 = "New connection\r\n";
 const char* SERVICE_READY 		 = "220 localhost service ready\r\n";
 const char* SERVICE_CLOSING		 = "221 localhost service closing transmission channel\r\n";
 const char* HELO_RESPONSE 		 = "250 localhost\r\n";
+const char* EHLO_RESPONSE 		 = "250-localhost\r\n250-PIPELINING\r\n250 CHUNKING\r\n";
 const char* OK 					 = "250 OK\r\n";
 const char* START_MAIL 			 = "354 Start mail input; end with <CRLF>.<CRLF>\r\n";
 const char* SERVICE_UNAVAILABLE  = "421 localhost service not available, closing transmission channel\r\n";
@@ -28,37 +42,169 @@ const char* UNRECGONIZED_COMMAND = "500 Syntax error, command unrecognized\r\n";
 const char* SYNTAX_ERROR 		 = "501 Syntax error in parameters or arguments\r\n";
 const char* BAD_SEQUENCE 		 = "503 Bad sequence of commands\r\n";
 const char* MAILBOX_UNAVAILABLE  = "550 Requested action not taken: mailbox unavailable\r\n";
+const char* LOCAL_ERROR 		 = "451 Requested action aborted: local error in processing\r\n";
 const char* CLOSE_CONN 			 = "Connection closed\r\n";
+const char* STORE_REF 			 = "X-Store-Ref: ";
 
 // constant integers
 const int BUFFER_SIZE 	= 16384;
 const int COMMAND_LEN 	= 4;
 const int RESPONSE_LEN 	= 128;
 const int MAILBOX_LEN 	= 64;
+const int MAX_EVENTS 	= 256;
+const int SPOOL_CHUNK 	= 65536;
+const int PATH_LEN 		= 4096;
+const int STORE_MIN_RCPTS = 2;
+const int RING_ENTRIES 	= 4096;
+const int RECV_BUFFERS 	= 1024;
+const int RECV_BUFFER_SIZE = 4096;
+
+// I/O backends of the event loops
+const int BACKEND_EPOLL = 0;
+const int BACKEND_URING = 1;
+
+// operations in flight on an io_uring, kept in the low bits of the session pointer in user_data
+const uint64_t RING_ACCEPT 	= 1;
+const uint64_t RING_RECV 	= 2;
+const uint64_t RING_SEND 	= 3;
+const uint64_t RING_CANCEL 	= 4;
+const uint64_t RING_OP_MASK = 7;
 
 // global variables
 vector< pthread_t > THREADS;
 vector< int > SOCKETS;
 char* PARENTDIR;
-unordered_set< string > MAILBOXES;
+MailboxRegistry MAILBOXES;
 bool DEBUG = false;
+int ACCEPTORS = 1;
+int BACKLOG = 100;
+bool PIN_CPUS = false;
+vector< int > LISTENERS;
+pthread_mutex_t REGISTRY_LOCK = PTHREAD_MUTEX_INITIALIZER;
+int EVENT_LOOPS = 0;
+vector< int > EPOLL_FDS;
+int DURABILITY = DURABLE_BATCH;
+DeliveryJournal JOURNAL;
+int UID_SCHEME = UID_MD5;
+int IO_BACKEND = BACKEND_URING;
+
+// DATA body of the current transaction. Lines are gathered in a bounded buffer and streamed to a spool file
+// under PARENTDIR/.spool, so a session holds at most SPOOL_CHUNK bytes of the message in memory.
+struct Spool {
+	int fd;
+	char path[PATH_LEN];
+	string pending;
+	bool failed;
+
+	Spool(): fd(-1), path(), failed(false) {}
+};
+
+// BDAT chunk being received. The payload is spliced from the socket into the spool file through a pipe.
+struct Chunk {
+	bool active;
+	long left;
+	long size;
+	bool last;
+	bool discard;
+	int pipe_fds[2];
+
+	Chunk(): active(false), left(0), size(0), last(false), discard(false) {
+		pipe_fds[0] = -1;
+		pipe_fds[1] = -1;
+	}
+};
+
+// io_uring event loop of -e mode, and which multishot operations the kernel turned out to support
+struct RingLoop {
+	IoRing ring;
+	bool multishot_accept;
+	bool multishot_recv;
+};
+
+// state of one client connection. Owned by its worker thread, or by one event loop thread in -e mode.
+struct Session {
+	int comm_fd;
+	int state;
+	// 0 - just connected
+	// 1 - HELO/RSET received
+	// 2 - MAIL received
+	// 3 - RCPT received
+	// 4 - DATA received
+	// 5 - DATA finished
+	// 6 - QUIT received
+	// 7 - BDAT chunks being received
+	bool is_data;
+	bool quit;
+
+	// responses are queued here and sent once per batch of pipelined commands
+	string out;
+	int epoll_fd;
+	bool want_out;
+
+	// with io_uring, the responses being sent stay put in sending while new ones queue in out; the session is
+	// freed once it is closing and no operation on it is in flight
+	RingLoop* loop;
+	string sending;
+	int inflight;
+	bool provided;
+	bool receiving;
+	bool send_armed;
+	bool closing;
+
+	// buffers for client's command
+	LineBuffer in;
+	char sender[MAILBOX_LEN];
+	vector< string > rcpts;
+	Spool spool;
+	Chunk chunk;
+
+	Session(int comm_fd): comm_fd(comm_fd), state(0), is_data(false), quit(false), epoll_fd(-1), want_out(false), 
+		loop(NULL), inflight(0), provided(false), receiving(false), send_armed(false), closing(false), in(BUFFER_SIZE), sender() {}
+};
 
 // function signatures
 void signal_handler(int arg);
 void get_mailboxes();
+void open_journal();
+int open_listener(unsigned short port);
+void accept_loop(int index);
+void* acceptor(void* arg);
 void* worker(void* arg);
-void handle_helo(int comm_fd, int* state, char* buffer, char* response);
-void handle_mail(int comm_fd, int* state, char* buffer, char* sender, char* response);
-void handle_rcpt(int comm_fd, int* state, char* buffer, vector< string >& rcpts, char* response);
-void handle_data(int comm_fd, int* state, bool* is_data, char* buffer, char* end, string& content, 
+void* event_loop(void* arg);
+void* ring_loop(void* arg);
+void arm_accept(RingLoop* loop, int listener);
+void arm_recv(Session* sess);
+void ring_accepted(RingLoop* loop, int listener, int res, unsigned flags);
+void ring_received(Session* sess, int res, unsigned flags);
+void ring_sent(Session* sess, int res);
+void ring_close(Session* sess);
+bool session_input(Session* sess);
+bool session_process(Session* sess);
+bool handle_commands(Session* sess);
+bool receive_chunk(Session* sess);
+void finish_chunk(Session* sess);
+void close_session(Session* sess);
+bool flush_output(Session* sess);
+void queue_response(string& out, char* response, const char* message);
+void handle_helo(string& out, int* state, char* buffer, bool extended, char* response);
+void handle_mail(string& out, int* state, char* buffer, char* sender, char* response);
+void handle_rcpt(string& out, int* state, char* buffer, vector< string >& rcpts, char* response);
+void handle_data(string& out, int* state, bool* is_data, char* buffer, char* end, Spool* spool, 
 	char* sender, vector< string >& rcpts, char* response);
-void handle_noop(int comm_fd, int* state, char* response);
-void handle_rset(int comm_fd, int* state, string& content, char* sender, vector < string >&rcpts, 
+void handle_noop(string& out, int* state, char* response);
+void handle_rset(string& out, int* state, Spool* spool, char* sender, vector < string >&rcpts, 
 	char* response);
-void handle_quit(int comm_fd, int* state, bool* quit, char* response);
+void handle_quit(string& out, int* state, bool* quit, char* response);
+void handle_bdat(string& out, int* state, char* buffer, Spool* spool, Chunk* chunk, char* response);
 void copy_mailbox(char* dest, char* src);
 void copy_rcpt_host(char* rcpt, char* host, char* src);
-void remove_command(char* buf, char* end);
+bool spool_open(Spool* spool);
+void spool_append(Spool* spool, const char* data, int len);
+bool spool_flush(Spool* spool);
+void spool_discard(Spool* spool);
+bool store_message(Spool* spool, char* sender, vector< string >& rcpts);
+bool deliver_spool(Spool* spool, char* sender, vector< string >& rcpts);
+bool append_message(string& path, string& header, int body_fd, off_t body_len, IndexRecord& record);
 
 // Main function of the program. Also the dispatcher of worker threads. This function parses command line 
 // arguments, set up the server, and dispatches worker threads to handle connections.
@@ -70,7 +216,7 @@ int main(int argc, char *argv[]) {
 	// port defaults to 2500 if no arguments given
 	unsigned short port = 2500;
 
-	while ((option = getopt(argc, argv, "p:av")) != -1) {
+	while ((option = getopt(argc, argv, "p:ave:l:b:cd:u:i:")) != -1) {
 		switch(option) {
 		case 'p':
 			port = atoi(optarg);
@@ -84,21 +230,111 @@ int main(int argc, char *argv[]) {
 			DEBUG = true;
 			break;
 
+		case 'e':
+			EVENT_LOOPS = atoi(optarg);
+			break;
+
+		case 'l':
+			ACCEPTORS = atoi(optarg) > 0 ? atoi(optarg) : 1;
+			break;
+
+		case 'b':
+			BACKLOG = atoi(optarg);
+			break;
+
+		case 'c':
+			PIN_CPUS = true;
+			break;
+
+		case 'd':
+			if (strcmp(optarg, "none") == 0) {
+				DURABILITY = DURABLE_NONE;
+			} else if (strcmp(optarg, "message") == 0) {
+				DURABILITY = DURABLE_MESSAGE;
+			} else {
+				DURABILITY = DURABLE_BATCH;
+			}
+			break;
+
+		case 'u':
+			UID_SCHEME = uid_scheme(optarg) >= 0 ? uid_scheme(optarg) : UID_MD5;
+			break;
+
+		case 'i':
+			IO_BACKEND = strcmp(optarg, "epoll") == 0 ? BACKEND_EPOLL : BACKEND_URING;
+			break;
+
 		default:
-			cerr << "Usage: " << argv[0] << " [-p port number] [-a] [-v] [mailbox directory]\r\n";
+			cerr << "Usage: " << argv[0] << " [-p port number] [-a] [-v] [-l acceptors] [-b backlog] [-c] [-e event loops] "
+			<< "[-d none|batch|message] [-u md5|fast] [-i uring|epoll] "
+			<< "[mailbox directory]\r\n";
 			exit(1);
 		}
 	}
 
 	// if no mailbox directory given
 	if (optind == argc) {
-		cerr << "Usage: " << argv[0] << " [-p port number] [-a] [-v] [mailbox directory]\r\n";
+		cerr << "Usage: " << argv[0] << " [-p port number] [-a] [-v] [-l acceptors] [-b backlog] [-c] [-e event loops] "
+			<< "[-d none|batch|message] [-u md5|fast] [-i uring|epoll] "
+			<< "[mailbox directory]\r\n";
 		exit(1);
 	}
-	PARENTDIR = (char*)malloc(sizeof(char*));
-	strcpy(PARENTDIR, argv[optind]);
+	PARENTDIR = strdup(argv[optind]);
 	get_mailboxes();
+	mkdir((string(PARENTDIR) + "/.spool").c_str(), 0700);
+	mkdir((string(PARENTDIR) + "/.store").c_str(), 0700);
+	open_journal();
+
+	// one listening socket per acceptor. With more than one, SO_REUSEPORT lets the kernel spread incoming
+	// connections across them.
+	for (int i = 0; i < ACCEPTORS; i++) {
+		LISTENERS.push_back(open_listener(port));
+	}
+
+	// in event loop mode, a fixed set of threads multiplexes all connections, with io_uring if the kernel has
+	// it and with epoll otherwise. Ring loops accept their own connections.
+	if (EVENT_LOOPS > 0 && IO_BACKEND == BACKEND_URING) {
+		IoRing probe;
+		if (!probe.start(8) || !probe.supports(IORING_OP_ACCEPT) || !probe.supports(IORING_OP_RECV)
+			|| !probe.supports(IORING_OP_SEND)) {
+			cerr << "io_uring not available, using epoll\r\n";
+			IO_BACKEND = BACKEND_EPOLL;
+		}
+	}
+	if (EVENT_LOOPS > 0 && IO_BACKEND == BACKEND_URING) {
+		for (int i = 0; i < EVENT_LOOPS; i++) {
+			pthread_t thread;
+			pthread_create(&thread, NULL, &ring_loop, (void*)(intptr_t)i);
+			THREADS.push_back(thread);
+		}
+		pause();
+		return 0;
+	}
+
+	for (int i = 0; i < EVENT_LOOPS; i++) {
+		EPOLL_FDS.push_back(epoll_create1(0));
+	}
+	for (int i = 0; i < EVENT_LOOPS; i++) {
+		pthread_t thread;
+		pthread_create(&thread, NULL, &event_loop, &EPOLL_FDS[i]);
+		THREADS.push_back(thread);
+	}
+
+	for (int i = 1; i < ACCEPTORS; i++) {
+		pthread_t thread;
+		pthread_create(&thread, NULL, &acceptor, (void*)(intptr_t)i);
+		pthread_mutex_lock(&REGISTRY_LOCK);
+		THREADS.push_back(thread);
+		pthread_mutex_unlock(&REGISTRY_LOCK);
+	}
+	accept_loop(0);
 
+	return 0;
+}
+
+// Opens a listening socket on the given port. Exits if the socket cannot be set up.
+// port:	port number to listen on
+int open_listener(unsigned short port) {
 	// connect to socket
 	int listen_fd = socket(PF_INET, SOCK_STREAM, 0);
 	if (listen_fd < 0) {
@@ -108,9 +344,12 @@ int main(int argc, char *argv[]) {
 
 	SOCKETS.push_back(listen_fd);
 	
-	// set port as reusable
+	// set port as reusable, and shareable between acceptors
 	const int enable = 1;
 	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
+	if (ACCEPTORS > 1) {
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int));
+	}
 
 	// set up server
 	struct sockaddr_in servaddr;
@@ -119,8 +358,29 @@ int main(int argc, char *argv[]) {
 	servaddr.sin_addr.s_addr = htons(INADDR_ANY);
 	servaddr.sin_port = htons(port);
 
-	bind(listen_fd, (struct sockaddr*)&servaddr, sizeof(servaddr));
-	listen(listen_fd, 100);
+	if (bind(listen_fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
+		cerr << "Error binding socket\r\n";
+		exit(1);
+	}
+	listen(listen_fd, BACKLOG);
+
+	return listen_fd;
+}
+
+// Accepts connections on one listening socket and dispatches them. The first listener is served by main, the
+// others by acceptor threads.
+// index:	index of the listening socket in LISTENERS
+void accept_loop(int index) {
+	int listen_fd = LISTENERS[index];
+
+	// optionally pin each acceptor to its own core
+	if (PIN_CPUS) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(index % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+	unsigned int next_loop = index;
 
 	while (true) {
 		// set up client connection
@@ -131,19 +391,43 @@ int main(int argc, char *argv[]) {
 		if (fd == -1) {
 			break;
 		}
+		pthread_mutex_lock(&REGISTRY_LOCK);
 		SOCKETS.push_back(fd);
+		pthread_mutex_unlock(&REGISTRY_LOCK);
 
 		if (DEBUG) {
 			cerr << "[" << fd << "] " << NEW_CONN;
 		}
 
+		Session* sess = new Session(fd);
+
+		if (EVENT_LOOPS > 0) {
+			// hand the connection to one of the event loops, round robin
+			write(fd, SERVICE_READY, strlen(SERVICE_READY));
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+			sess->epoll_fd = EPOLL_FDS[next_loop++ % EVENT_LOOPS];
+			struct epoll_event event;
+			event.events = EPOLLIN | EPOLLRDHUP;
+			event.data.ptr = sess;
+			epoll_ctl(sess->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+			continue;
+		}
+
 		pthread_t thread;
-		THREADS.push_back(thread);
 		// dispatch worker thread to handle client communication
-		pthread_create(&thread, NULL, &worker, &fd);
+		pthread_create(&thread, NULL, &worker, sess);
+		pthread_mutex_lock(&REGISTRY_LOCK);
+		THREADS.push_back(thread);
+		pthread_mutex_unlock(&REGISTRY_LOCK);
 	}
+}
 
-	return 0;
+// Acceptor thread for an additional listening socket.
+// arg: index of the listening socket in LISTENERS
+void* acceptor(void* arg) {
+	accept_loop((intptr_t)arg);
+	pthread_exit(NULL);
 }
 
 // Handler of SIGINT. Once SIGINT is received, this function writes a message to clients, closes their 
@@ -156,195 +440,688 @@ void signal_handler(int arg) {
 	for (int i = 1; i < SOCKETS.size(); i++) {
 		write(SOCKETS[i], SERVICE_UNAVAILABLE, strlen(SERVICE_UNAVAILABLE));
 		close(SOCKETS[i]);
-		pthread_kill(THREADS[i - 1], 0);
+	}
+
+	for (int i = 0; i < THREADS.size(); i++) {
+		pthread_kill(THREADS[i], 0);
 	}
 }
 
-// Read the mailbox directory and add mailboxes to a hashset.
+// Load the mailbox directory into the registry, which keeps itself current as mailboxes are added or removed.
 void get_mailboxes() {
-	DIR* mbdir;
-	struct dirent* entry;
-
-	if ((mbdir = opendir(PARENTDIR)) != NULL) {
-		int i = 0;
-		while ((entry = readdir(mbdir)) != NULL) {
-			if (i > 1) {
-				string mailbox(entry->d_name);
-				MAILBOXES.insert(mailbox);
-			}
-			i++;
-		}
-		closedir(mbdir);
-	} else {
+	if (!MAILBOXES.start(PARENTDIR)) {
 		cerr << "Mailbox directory does not exist\r\n";
 		exit(1);
 	}
 }
 
+// Opens the delivery journal and replays messages that were acknowledged but not yet synced into their
+// mailboxes when the server last stopped. Exits if the journal cannot be opened.
+void open_journal() {
+	vector< Delivery* > unfinished;
+	if (!JOURNAL.start(PARENTDIR, DURABILITY, unfinished)) {
+		cerr << "Cannot open delivery journal\r\n";
+		exit(1);
+	}
+
+	for (int i = 0; i < unfinished.size(); i++) {
+		Spool spool;
+		char sender[MAILBOX_LEN];
+		snprintf(spool.path, PATH_LEN, "%s", unfinished[i]->spool_path.c_str());
+		snprintf(sender, MAILBOX_LEN, "%s", unfinished[i]->sender.c_str());
+		spool.fd = open(spool.path, O_RDONLY);
+		if (spool.fd >= 0) {
+			deliver_spool(&spool, sender, unfinished[i]->rcpts);
+		}
+		unfinished[i]->spool_fd = spool.fd;
+		JOURNAL.finish(unfinished[i]);
+	}
+	if (unfinished.size() > 0) {
+		cerr << "Replayed " << unfinished.size() << " deliveries from the journal\r\n";
+	}
+}
+
 // Worker thread that handles the connection. One thread for one client.
-// arg: file descriptor of the socket the client connects to.
+// arg: session of the client, which the worker takes ownership of.
 void* worker(void* arg) {
-	int comm_fd = *(int*)arg;
-	write(comm_fd, SERVICE_READY, strlen(SERVICE_READY));
+	Session* sess = (Session*)arg;
+	write(sess->comm_fd, SERVICE_READY, strlen(SERVICE_READY));
 
-	int state = 0;
-	// 0 - just connected
-	// 1 - HELO/RSET received
-	// 2 - MAIL received
-	// 3 - RCPT received
-	// 4 - DATA received
-	// 5 - DATA finished
-	// 6 - QUIT received
+	// into one connection
+	while (session_input(sess)) {}
 
-	// buffers for client's command
-	char buf[BUFFER_SIZE];
-	char* curr = buf;
-	bool quit = false;
+	close_session(sess);
+	pthread_exit(NULL);
+}
 
-	char sender[MAILBOX_LEN];
-	vector< string > rcpts;
-	bool is_data = false;
-	string content;
+// Event loop thread used in -e mode. Waits on its epoll instance and feeds readable connections through
+// the same command state machine as the worker threads.
+// arg: epoll file descriptor owned by this loop.
+void* event_loop(void* arg) {
+	int epoll_fd = *(int*)arg;
+	struct epoll_event events[MAX_EVENTS];
 
-	// into one connection
-	while (!quit) {
-		int curr_len = strlen(buf);
-		int rlen = read(comm_fd, curr, BUFFER_SIZE - curr_len);
-		char* end = (char*)malloc(sizeof(char*));
-
-		// into one command - if command contains "<CR><LF>", enter loop
-		while ((end = strstr(buf, "\r\n")) != NULL) {
-			// move end to the end of "<CR><LF>"
-			end += 2;
-
-			char command[COMMAND_LEN];
-			for (int i = 0; i < COMMAND_LEN; i++) {
-				command[i] = buf[i];
+	while (true) {
+		int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
 			}
+			break;
+		}
 
-			char response[RESPONSE_LEN];
-
-			// HELO response
-			if (strcasecmp(command, "helo") == 0) {
-				handle_helo(comm_fd, &state, buf, response);
-			
-			// MAIL response
-			} else if (strcasecmp(command, "mail") == 0) {
-				handle_mail(comm_fd, &state, buf, sender, response);
-			
-			// RCPT response
-			} else if (strcasecmp(command, "rcpt") == 0) {
-				handle_rcpt(comm_fd, &state, buf, rcpts, response);
-			
-			// DATA response
-			} else if (strcasecmp(command, "data") == 0 || is_data) {
-				handle_data(comm_fd, &state, &is_data, buf, end, content, sender, rcpts, response);
-
-			// NOOP response
-			} else if (strcasecmp(command, "noop") == 0) {
-				handle_noop(comm_fd, &state, response);
-
-			// RSET response
-			} else if (strcasecmp(command, "rset") == 0) {
-				handle_rset(comm_fd, &state, content, sender, rcpts, response);
-
-			// QUIT response
-			} else if (strcasecmp(command, "quit") == 0) {
-				handle_quit(comm_fd, &state, &quit, response);
-
-			// unknown command response
-			} else {
-				write(comm_fd, UNRECGONIZED_COMMAND, strlen(UNRECGONIZED_COMMAND));
-				strcpy(response, UNRECGONIZED_COMMAND);
+		for (int i = 0; i < n; i++) {
+			Session* sess = (Session*)events[i].data.ptr;
+			bool open = true;
+
+			if (events[i].events & EPOLLOUT) {
+				open = flush_output(sess);
+			}
+			if (open && (events[i].events & ~EPOLLOUT)) {
+				open = session_input(sess);
+			}
+			if (!open) {
+				close_session(sess);
+			}
+		}
+	}
+
+	pthread_exit(NULL);
+}
+
+// Event loop thread used in -e mode when the kernel has io_uring. Each loop owns a ring and accepts on its
+// share of the listening sockets; accepts, receives and sends of all its connections are submitted as entries,
+// and everything queued while handling one batch of completions goes to the kernel in the single
+// io_uring_enter() that waits for the next batch.
+// arg: index of the loop
+void* ring_loop(void* arg) {
+	int index = (intptr_t)arg;
+	RingLoop* loop = new RingLoop();
+	if (!loop->ring.start(RING_ENTRIES)) {
+		cerr << "Cannot set up io_uring\r\n";
+		exit(1);
+	}
+	// multishot receives need provided buffers, which also keep idle connections from holding any
+	loop->multishot_recv = loop->ring.provide_buffers(0, RECV_BUFFERS, RECV_BUFFER_SIZE);
+	loop->multishot_accept = true;
+
+	if (PIN_CPUS) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(index % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+
+	// every listener has at least one loop, and every loop at least one listener
+	int listeners = LISTENERS.size();
+	for (int j = 0; j < listeners; j++) {
+		if (j % EVENT_LOOPS == index || index % listeners == j) {
+			arm_accept(loop, j);
+		}
+	}
+
+	while (loop->ring.submit(1)) {
+		struct io_uring_cqe* cqe;
+		while ((cqe = loop->ring.completion()) != NULL) {
+			uint64_t data = cqe->user_data;
+			int res = cqe->res;
+			unsigned flags = cqe->flags;
+			loop->ring.consume();
+
+			Session* sess = (Session*)(uintptr_t)(data & ~RING_OP_MASK);
+			switch (data & RING_OP_MASK) {
+			case RING_ACCEPT:
+				ring_accepted(loop, data >> 3, res, flags);
+				break;
+			case RING_RECV:
+				ring_received(sess, res, flags);
+				break;
+			case RING_SEND:
+				ring_sent(sess, res);
+				break;
 			}
 
-			if (DEBUG) {
-				fprintf(stderr, "[%d] C: %.*s", comm_fd, (int)(end - buf), buf);
-				fprintf(stderr, "[%d] S: %s", comm_fd, response);
+			if ((data & RING_OP_MASK) != RING_ACCEPT && (data & RING_OP_MASK) != RING_CANCEL 
+				&& sess->closing && sess->inflight == 0) {
+				close_session(sess);
 			}
+		}
+	}
 
-			if (quit) {
+	pthread_exit(NULL);
+}
+
+// Submits an accept on a listening socket, multishot if the kernel has it.
+// loop:		event loop
+// listener:	index of the listening socket in LISTENERS
+void arm_accept(RingLoop* loop, int listener) {
+	struct io_uring_sqe* sqe = loop->ring.sqe();
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = LISTENERS[listener];
+	sqe->ioprio = loop->multishot_accept ? IORING_ACCEPT_MULTISHOT : 0;
+	sqe->user_data = ((uint64_t)listener << 3) | RING_ACCEPT;
+}
+
+// Sets up a connection accepted through the ring: greets the client and submits its first receive.
+// loop:		event loop
+// listener:	index of the listening socket in LISTENERS
+// res:			accepted socket, or -errno
+// flags:		completion flags
+void ring_accepted(RingLoop* loop, int listener, int res, unsigned flags) {
+	if (res == -EINVAL && loop->multishot_accept) {
+		loop->multishot_accept = false;
+	}
+	if (!(flags & IORING_CQE_F_MORE)) {
+		arm_accept(loop, listener);
+	}
+	if (res < 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&REGISTRY_LOCK);
+	SOCKETS.push_back(res);
+	pthread_mutex_unlock(&REGISTRY_LOCK);
+	if (DEBUG) {
+		cerr << "[" << res << "] " << NEW_CONN;
+	}
+
+	Session* sess = new Session(res);
+	sess->loop = loop;
+	sess->provided = loop->multishot_recv;
+	sess->out += SERVICE_READY;
+	flush_output(sess);
+	arm_recv(sess);
+}
+
+// Submits a receive for a session: multishot into the provided buffers, or single-shot into its line buffer.
+// sess:	client's session
+void arm_recv(Session* sess) {
+	RingLoop* loop = sess->loop;
+	struct io_uring_sqe* sqe = loop->ring.sqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = sess->comm_fd;
+	sqe->user_data = (uint64_t)(uintptr_t)sess | RING_RECV;
+	if (sess->provided) {
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = loop->ring.group();
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+	} else {
+		int space;
+		sqe->addr = (uint64_t)(uintptr_t)sess->in.space(&space);
+		sqe->len = space;
+	}
+	sess->receiving = true;
+	sess->inflight++;
+}
+
+// Handles data received for a session, and submits the next receive unless the multishot one goes on.
+// sess:	client's session
+// res:		number of bytes received, or -errno
+// flags:	completion flags
+void ring_received(Session* sess, int res, unsigned flags) {
+	RingLoop* loop = sess->loop;
+	if (!(flags & IORING_CQE_F_MORE)) {
+		sess->receiving = false;
+		sess->inflight--;
+	}
+	if (sess->closing) {
+		if (flags & IORING_CQE_F_BUFFER) {
+			loop->ring.recycle(flags >> IORING_CQE_BUFFER_SHIFT);
+		}
+		return;
+	}
+
+	// when more connections have data at once than there are provided buffers, the ones left without a buffer
+	// receive into their own buffers from then on, rather than failing again at every burst. -EINVAL is a
+	// kernel without multishot receives.
+	if (res == -ENOBUFS || (res == -EINVAL && sess->provided)) {
+		loop->multishot_recv = loop->multishot_recv && res == -ENOBUFS;
+		sess->provided = false;
+		if (!sess->receiving) {
+			arm_recv(sess);
+		}
+		return;
+	}
+	if (res <= 0) {
+		ring_close(sess);
+		return;
+	}
+
+	bool open = true;
+	if (flags & IORING_CQE_F_BUFFER) {
+		unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+		char* data = loop->ring.buffer(id);
+		while (open && res > 0) {
+			int space;
+			char* dest = sess->in.space(&space);
+			if (space == 0) {
+				open = false;
 				break;
 			}
+			int len = min(space, res);
+			memcpy(dest, data, len);
+			sess->in.produced(len);
+			data += len;
+			res -= len;
+			open = session_process(sess);
+		}
+		loop->ring.recycle(id);
+	} else {
+		sess->in.produced(res);
+		open = session_process(sess);
+	}
 
-			// clear buffer of one full command
-			remove_command(buf, end);
+	if (!open) {
+		ring_close(sess);
+	} else if (!sess->receiving) {
+		arm_recv(sess);
+	}
+}
+
+// Handles a completed send: drops what was sent and submits the rest, or the responses queued meanwhile.
+// sess:	client's session
+// res:		number of bytes sent, or -errno
+void ring_sent(Session* sess, int res) {
+	sess->send_armed = false;
+	sess->inflight--;
+	if (res <= 0) {
+		sess->sending.clear();
+		ring_close(sess);
+		return;
+	}
+	sess->sending.erase(0, res);
+	flush_output(sess);
+}
+
+// Starts closing a session. Its pending receive is cancelled; queued responses such as the reply to QUIT are
+// still sent, and the session is freed once nothing on it is in flight.
+// sess:	client's session
+void ring_close(Session* sess) {
+	if (sess->closing) {
+		return;
+	}
+	sess->closing = true;
+	if (sess->receiving) {
+		struct io_uring_sqe* sqe = sess->loop->ring.sqe();
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = (uint64_t)(uintptr_t)sess | RING_RECV;
+		sqe->user_data = RING_CANCEL;
+	}
+}
+
+// Reads once from the client and handles every complete command in the buffer. Returns false once the client
+// has quit or closed the connection; a read that would block on a non-blocking socket returns true.
+// sess:	client's session
+bool session_input(Session* sess) {
+	// the rest of a BDAT chunk goes from the socket straight to the spool file
+	if (!sess->chunk.active) {
+		LineBuffer& in = sess->in;
+		int space;
+		char* dest = in.space(&space);
+		int rlen = read(sess->comm_fd, dest, space);
+		if (rlen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+			return true;
 		}
+		if (rlen <= 0) {
+			return false;
+		}
+		in.produced(rlen);
+	}
 
-		if (quit) {
-			break;
+	return session_process(sess);
+}
+
+// Handles the input that has arrived in the session's buffer: the rest of a BDAT chunk, then every complete
+// command. Returns false once the client has quit or the connection is broken.
+// sess:	client's session
+bool session_process(Session* sess) {
+	if (sess->chunk.active) {
+		if (!receive_chunk(sess)) {
+			return false;
+		}
+		if (sess->chunk.active) {
+			return true;
+		}
+	}
+	return handle_commands(sess);
+}
+
+// Handles every complete command in the session's buffer, then sends the responses. Returns false once the
+// client has quit or the connection is broken.
+// sess:	client's session
+bool handle_commands(Session* sess) {
+	int comm_fd = sess->comm_fd;
+	LineBuffer& in = sess->in;
+
+	// into one command - for every complete line ending with "<CR><LF>"
+	char* buf;
+	int len;
+	while ((buf = in.next_line(&len)) != NULL) {
+		char* end = buf + len;
+
+		char command[COMMAND_LEN + 1];
+		for (int i = 0; i < COMMAND_LEN; i++) {
+			command[i] = buf[i];
+		}
+		command[COMMAND_LEN] = '\0';
+
+		char response[RESPONSE_LEN];
+
+		// DATA response - while a message is being read, every line belongs to it
+		if (sess->is_data || strcasecmp(command, "data") == 0) {
+			handle_data(sess->out, &sess->state, &sess->is_data, buf, end, &sess->spool, sess->sender, 
+				sess->rcpts, response);
+
+		// HELO response
+		} else if (strcasecmp(command, "helo") == 0) {
+			handle_helo(sess->out, &sess->state, buf, false, response);
+
+		// EHLO response
+		} else if (strcasecmp(command, "ehlo") == 0) {
+			handle_helo(sess->out, &sess->state, buf, true, response);
+		
+		// MAIL response
+		} else if (strcasecmp(command, "mail") == 0) {
+			handle_mail(sess->out, &sess->state, buf, sess->sender, response);
+		
+		// RCPT response
+		} else if (strcasecmp(command, "rcpt") == 0) {
+			handle_rcpt(sess->out, &sess->state, buf, sess->rcpts, response);
+
+		// BDAT response - sent once the chunk has been received
+		} else if (strcasecmp(command, "bdat") == 0) {
+			handle_bdat(sess->out, &sess->state, buf, &sess->spool, &sess->chunk, response);
+
+		// NOOP response
+		} else if (strcasecmp(command, "noop") == 0) {
+			handle_noop(sess->out, &sess->state, response);
+
+		// RSET response
+		} else if (strcasecmp(command, "rset") == 0) {
+			handle_rset(sess->out, &sess->state, &sess->spool, sess->sender, sess->rcpts, response);
+
+		// QUIT response
+		} else if (strcasecmp(command, "quit") == 0) {
+			handle_quit(sess->out, &sess->state, &sess->quit, response);
+
+		// unknown command response
+		} else {
+			queue_response(sess->out, response, UNRECGONIZED_COMMAND);
+		}
+
+		if (DEBUG) {
+			fprintf(stderr, "[%d] C: %.*s", comm_fd, (int)(end - buf), buf);
+			fprintf(stderr, "[%d] S: %s", comm_fd, response);
+		}
+
+		if (sess->quit) {
+			flush_output(sess);
+			return false;
+		}
+
+		// clear buffer of one full command
+		in.consume();
+
+		// the chunk following BDAT is not line oriented
+		if (sess->chunk.active) {
+			if (!receive_chunk(sess)) {
+				return false;
+			}
+			if (sess->chunk.active) {
+				break;
+			}
 		}
+	}
+
+	// one send for the responses to everything the client pipelined
+	return flush_output(sess);
+}
 
-		// reset curr to point to the end of buffer
-		curr = buf;
-		while (*curr != '\0') {
-			curr++;
+// Moves the rest of the current BDAT chunk into the spool file. Bytes that arrived with the command are taken
+// from the buffer; the remainder is spliced from the socket through a pipe into the spool file, so it is never
+// copied into user space. On a non-blocking socket this returns when no more data is available. Returns false
+// if the connection is broken.
+// sess:	client's session
+bool receive_chunk(Session* sess) {
+	Chunk* chunk = &sess->chunk;
+	Spool* spool = &sess->spool;
+
+	int len;
+	char* data = sess->in.peek(&len);
+	if (len > chunk->left) {
+		len = chunk->left;
+	}
+	if (!chunk->discard) {
+		spool_append(spool, data, len);
+	}
+	sess->in.skip(len);
+	chunk->left -= len;
+
+	// with io_uring, the rest of the chunk arrives through the ring's receives like any other input
+	if (sess->loop != NULL) {
+		if (chunk->left == 0) {
+			finish_chunk(sess);
 		}
-		free(end);
+		return true;
 	}
 
-	close(comm_fd);
+	// buffered lines must reach the spool file before spliced data
+	if (chunk->left > 0 && !chunk->discard && !spool_flush(spool)) {
+		chunk->discard = true;
+	}
+	if (chunk->left > 0 && chunk->pipe_fds[0] < 0 && pipe(chunk->pipe_fds) < 0) {
+		return false;
+	}
+
+	while (chunk->left > 0) {
+		ssize_t in_pipe = splice(sess->comm_fd, NULL, chunk->pipe_fds[1], NULL, min(chunk->left, (long)SPOOL_CHUNK), 
+			SPLICE_F_MOVE);
+		if (in_pipe < 0 && errno == EINTR) {
+			continue;
+		}
+		if (in_pipe < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return true;
+		}
+		if (in_pipe <= 0) {
+			return false;
+		}
+		chunk->left -= in_pipe;
+
+		// drain the pipe into the spool file, or drop the data if the chunk is rejected
+		while (in_pipe > 0) {
+			ssize_t moved = -1;
+			if (!chunk->discard) {
+				moved = splice(chunk->pipe_fds[0], NULL, spool->fd, NULL, in_pipe, SPLICE_F_MOVE);
+				if (moved <= 0) {
+					chunk->discard = true;
+					spool->failed = true;
+				}
+			}
+			if (chunk->discard) {
+				char scratch[4096];
+				moved = read(chunk->pipe_fds[0], scratch, min(in_pipe, (ssize_t)sizeof(scratch)));
+				if (moved <= 0) {
+					return false;
+				}
+			}
+			in_pipe -= moved;
+		}
+	}
+
+	finish_chunk(sess);
+	return true;
+}
+
+// Replies to a BDAT command once its chunk has been received. After the LAST chunk, the message is delivered.
+// sess:	client's session
+void finish_chunk(Session* sess) {
+	Chunk* chunk = &sess->chunk;
+	char response[RESPONSE_LEN];
+	chunk->active = false;
+
+	// an error reply was already sent when the command was rejected
+	if (chunk->discard && sess->state != 7) {
+		chunk->discard = false;
+		return;
+	}
+
+	if (chunk->last) {
+		// keep the mailbox line oriented even if the message does not end with a line break
+		char tail = '\n';
+		off_t spooled = lseek(sess->spool.fd, 0, SEEK_CUR);
+		if (!sess->spool.pending.empty()) {
+			tail = sess->spool.pending[sess->spool.pending.length() - 1];
+		} else if (spooled > 0) {
+			pread(sess->spool.fd, &tail, 1, spooled - 1);
+		}
+		if (!chunk->discard && tail != '\n') {
+			spool_append(&sess->spool, "\r\n", 2);
+		}
+
+		const char* reply = !chunk->discard && store_message(&sess->spool, sess->sender, sess->rcpts) ? OK 
+			: LOCAL_ERROR;
+		spool_discard(&sess->spool);
+		sess->sender[0] = '\0';
+		sess->rcpts.clear();
+		sess->state = 5;
+		queue_response(sess->out, response, reply);
+	} else {
+		snprintf(response, RESPONSE_LEN, "250 %ld octets received\r\n", chunk->size);
+		sess->out += response;
+	}
+	chunk->discard = false;
+
 	if (DEBUG) {
-		cerr << "[" << comm_fd << "] " << CLOSE_CONN;
+		fprintf(stderr, "[%d] S: %s", sess->comm_fd, response);
 	}
-	pthread_exit(NULL);
 }
 
-// Handler for HELO command. Checks whether the transaction is at the correct state and send response
-// accordingly. Checks whether there is an argument after HELO. If there is not, a 501 is returned.
-// comm_fd: 	client's socket
+// Sends the queued responses. A blocking socket sends everything; on a non-blocking socket whatever the kernel
+// does not take stays queued and the event loop waits for EPOLLOUT. With io_uring the responses are submitted
+// as one send, which goes to the kernel with the loop's next wait. Returns false if the connection is broken.
+// sess:	client's session
+bool flush_output(Session* sess) {
+	if (sess->loop != NULL) {
+		if (sess->sending.empty()) {
+			sess->sending.swap(sess->out);
+		}
+		if (!sess->sending.empty() && !sess->send_armed) {
+			struct io_uring_sqe* sqe = sess->loop->ring.sqe();
+			sqe->opcode = IORING_OP_SEND;
+			sqe->fd = sess->comm_fd;
+			sqe->addr = (uint64_t)(uintptr_t)sess->sending.data();
+			sqe->len = sess->sending.length();
+			sqe->msg_flags = MSG_NOSIGNAL;
+			sqe->user_data = (uint64_t)(uintptr_t)sess | RING_SEND;
+			sess->send_armed = true;
+			sess->inflight++;
+		}
+		return true;
+	}
+
+	size_t sent = 0;
+	while (sent < sess->out.length()) {
+		ssize_t wlen = send(sess->comm_fd, sess->out.data() + sent, sess->out.length() - sent, MSG_NOSIGNAL);
+		if (wlen < 0 && errno == EINTR) {
+			continue;
+		}
+		if (wlen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		}
+		if (wlen <= 0) {
+			return false;
+		}
+		sent += wlen;
+	}
+	sess->out.erase(0, sent);
+
+	// only watch for writability while responses are left over
+	bool want_out = !sess->out.empty();
+	if (sess->epoll_fd >= 0 && want_out != sess->want_out) {
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLRDHUP | (want_out ? EPOLLOUT : 0);
+		event.data.ptr = sess;
+		epoll_ctl(sess->epoll_fd, EPOLL_CTL_MOD, sess->comm_fd, &event);
+		sess->want_out = want_out;
+	}
+	return true;
+}
+
+// Queues a response to the client and records it for debug output.
+// out:			client's output buffer
+// response:	response written to client
+// message:		response to queue
+void queue_response(string& out, char* response, const char* message) {
+	out += message;
+	strcpy(response, message);
+}
+
+// Closes the client's socket and frees its session. Closing the socket also removes it from any epoll set.
+// sess:	client's session
+void close_session(Session* sess) {
+	spool_discard(&sess->spool);
+	if (sess->chunk.pipe_fds[0] >= 0) {
+		close(sess->chunk.pipe_fds[0]);
+		close(sess->chunk.pipe_fds[1]);
+	}
+	close(sess->comm_fd);
+	if (DEBUG) {
+		cerr << "[" << sess->comm_fd << "] " << CLOSE_CONN;
+	}
+	delete sess;
+}
+
+// Handler for HELO and EHLO commands. Checks whether the transaction is at the correct state and send response
+// accordingly. Checks whether there is an argument after HELO. If there is not, a 501 is returned. EHLO also
+// lists the supported extensions.
+// out: 		client's output buffer
 // state: 		current transaction state
 // buffer:		master buffer for client's command
+// extended:	true for EHLO
 // response:	response written to client
-void handle_helo(int comm_fd, int* state, char* buffer, char* response) {
+void handle_helo(string& out, int* state, char* buffer, bool extended, char* response) {
 	if (*state > 1) {
-		write(comm_fd, BAD_SEQUENCE, strlen(BAD_SEQUENCE));
-		strcpy(response, BAD_SEQUENCE);
+		queue_response(out, response, BAD_SEQUENCE);
 	} else {
 		string buf(buffer);
 		buf.erase(buf.find_last_not_of(" \n\r\t") + 1);
 
 		if (buf.length() <= 4) {
-			write(comm_fd, SYNTAX_ERROR, strlen(SYNTAX_ERROR));
-			strcpy(response, SYNTAX_ERROR);
+			queue_response(out, response, SYNTAX_ERROR);
 		} else {
-			write(comm_fd, HELO_RESPONSE, strlen(HELO_RESPONSE));
+			queue_response(out, response, extended ? EHLO_RESPONSE : HELO_RESPONSE);
 			*state = 1;
-			strcpy(response, HELO_RESPONSE);
 		}
 	}
 }
 
 // Handler for MAIL command. Checks whether the transaction is at the correct state and send response
 // accordingly. Copies the sender's email to a buffer.
-// comm_fd: 	client's socket
+// out: 		client's output buffer
 // state: 		current transaction state
 // buffer:		master buffer for client's command
 // sender:		buffer to keep track of sender's email
 // response:	response written to client
-void handle_mail(int comm_fd, int* state, char* buffer, char* sender, char* response) {
+void handle_mail(string& out, int* state, char* buffer, char* sender, char* response) {
 	if (*state != 1) {
-		write(comm_fd, BAD_SEQUENCE, strlen(BAD_SEQUENCE));
-		strcpy(response, BAD_SEQUENCE);
+		queue_response(out, response, BAD_SEQUENCE);
 	} else {
 		copy_mailbox(sender, buffer);
-		write(comm_fd, OK, strlen(OK));
-		strcpy(response, OK);
+		queue_response(out, response, OK);
 		*state = 2;
 	}
 }
 
 // Handler for RCPT command. Checks whether the transaction is at the correct state and send response
 // accordingly. Checks whether the recipients exist. If so, copies their emails to a buffer.
-// comm_fd: 	client's socket
+// out: 		client's output buffer
 // state: 		current transaction state
 // buffer:		master buffer for client's command
 // rcpts:		buffer to keep track of recipients
 // response:	response written to client
-void handle_rcpt(int comm_fd, int* state, char* buffer, vector< string >& rcpts, char* response) {
+void handle_rcpt(string& out, int* state, char* buffer, vector< string >& rcpts, char* response) {
 	if (*state < 2 || *state > 3) {
-		write(comm_fd, BAD_SEQUENCE, strlen(BAD_SEQUENCE));
-		strcpy(response, BAD_SEQUENCE);
+		queue_response(out, response, BAD_SEQUENCE);
 	} else {
 		char rcpt[MAILBOX_LEN];
 		char host[MAILBOX_LEN];
@@ -352,13 +1129,11 @@ void handle_rcpt(int comm_fd, int* state, char* buffer, vector< string >& rcpts,
 		string mbox(rcpt);
 		mbox += ".mbox";
 
-		if (strcmp(host, "localhost") != 0 || MAILBOXES.find(mbox) == MAILBOXES.end()) {
-			write(comm_fd, MAILBOX_UNAVAILABLE, strlen(MAILBOX_UNAVAILABLE));
-			strcpy(response, MAILBOX_UNAVAILABLE);
+		if (strcmp(host, "localhost") != 0 || !MAILBOXES.contains(mbox)) {
+			queue_response(out, response, MAILBOX_UNAVAILABLE);
 		} else {
 			rcpts.push_back(mbox);
-			write(comm_fd, OK, strlen(OK));
-			strcpy(response, OK);
+			queue_response(out, response, OK);
 
 			*state = 3;
 		}
@@ -366,110 +1141,137 @@ void handle_rcpt(int comm_fd, int* state, char* buffer, vector< string >& rcpts,
 }
 
 // Handler for DATA command. Checks whether the transaction is at the correct state and send response
-// accordingly. Read client's message until <CR><LF>.<CR><LF> is received. When the full message is read,
-// write it to recipients files and clear buffers.
-// comm_fd: 	client's socket
+// accordingly. Streams client's message to a spool file until <CR><LF>.<CR><LF> is received. When the full 
+// message is read, deliver it to recipients files and clear buffers.
+// out: 		client's output buffer
 // state: 		current transaction state
 // is_data:		true if the message is not finished
 // buffer:		master buffer for client's command
 // end:			pointer to the end of one line in buffer
-// content:		buffer to keep track of email message
+// spool:		spool of the email message
 // sender:		sender of the email
 // rcpts:		recipients of the email
 // response:	response written to client
-void handle_data(int comm_fd, int* state, bool* is_data, char* buffer, char* end, string& content, 
+void handle_data(string& out, int* state, bool* is_data, char* buffer, char* end, Spool* spool, 
 	char* sender, vector< string >& rcpts, char* response) {
 
 	if (*state < 3 || *state > 4) {
-		write(comm_fd, BAD_SEQUENCE, strlen(BAD_SEQUENCE));
-		strcpy(response, BAD_SEQUENCE);
+		queue_response(out, response, BAD_SEQUENCE);
 	} else if (strcmp(buffer, ".\r\n") == 0) {
 		*is_data = false;
 		*state = 5;
 
-		for (int i = 0; i < rcpts.size(); i++) {
-			ofstream mbox;
-			mbox.open(string(PARENTDIR) + "/" + rcpts[i], ios_base::app);
-
-			time_t now = time(0);
-			string timestamp = "From ";
-			timestamp = timestamp + sender + " " + ctime(&now);
-
-			mbox << timestamp << content;
-			mbox.close();
-		}
-
-		content.clear();
+		const char* reply = store_message(spool, sender, rcpts) ? OK : LOCAL_ERROR;
+		spool_discard(spool);
 		sender[0] = '\0';
 		rcpts.clear();
 
-		write(comm_fd, OK, strlen(OK));
-		strcpy(response, OK);		
+		queue_response(out, response, reply);
 	} else if (!*is_data) {
-		write(comm_fd, START_MAIL, strlen(START_MAIL));
-		strcpy(response, START_MAIL);
+		if (!spool_open(spool)) {
+			queue_response(out, response, LOCAL_ERROR);
+			return;
+		}
+
+		queue_response(out, response, START_MAIL);
 
 		*is_data = true;
 		*state = 4;
 	} else {
-		string line(buffer, end - buffer);
-		content += line;
+		// undo the client's dot-stuffing, so the mailbox holds the message as written
+		if (buffer[0] == '.') {
+			buffer++;
+		}
+		spool_append(spool, buffer, end - buffer);
+		response[0] = '\n';
+		response[1] = '\0';
+	}
+}
+
+// Handler for BDAT command. Checks whether the transaction is at the correct state and the chunk size is valid.
+// The chunk itself is received afterwards by receive_chunk(), which also sends the response. A rejected chunk 
+// is still read, and dropped.
+// out: 		client's output buffer
+// state: 		current transaction state
+// buffer:		master buffer for client's command
+// spool:		spool of the email message
+// chunk:		chunk to receive
+// response:	response written to client
+void handle_bdat(string& out, int* state, char* buffer, Spool* spool, Chunk* chunk, char* response) {
+	long size = -1;
+	char last[8] = "";
+	int args = sscanf(buffer + COMMAND_LEN, " %ld %7s", &size, last);
+
+	if (args < 1 || size < 0 || (args == 2 && strcasecmp(last, "last") != 0)) {
+		queue_response(out, response, SYNTAX_ERROR);
+		return;
+	}
+
+	chunk->active = true;
+	chunk->left = size;
+	chunk->size = size;
+	chunk->last = args == 2;
+	chunk->discard = false;
+
+	if (*state != 3 && *state != 7) {
+		queue_response(out, response, BAD_SEQUENCE);
+		chunk->discard = true;
+	} else if (*state == 3 && !spool_open(spool)) {
+		queue_response(out, response, LOCAL_ERROR);
+		chunk->discard = true;
+	} else {
+		*state = 7;
 		response[0] = '\n';
 		response[1] = '\0';
 	}
 }
 
 // Handler for NOOP command. If the client already said HELO, reply with OK. If not, send an 503 error.
-// comm_fd: 	client's socket
+// out: 		client's output buffer
 // state:		current transaction state
 // response:	response written to client
-void handle_noop(int comm_fd, int* state, char* response) {
+void handle_noop(string& out, int* state, char* response) {
 	if (*state == 0) {
-		write(comm_fd, BAD_SEQUENCE, strlen(BAD_SEQUENCE));
-		strcpy(response, BAD_SEQUENCE);
+		queue_response(out, response, BAD_SEQUENCE);
 	} else {
-		write(comm_fd, OK, strlen(OK));
-		strcpy(response, OK);
+		queue_response(out, response, OK);
 	}
 }
 
 // Handler for RSET command. Checks whether the transaction is at the correct state and send response
 // accordingly. Clear all buffers and return to the state before transaction.
-// comm_fd: 	client's socket
+// out: 		client's output buffer
 // state: 		current transaction state
-// content:		email message
+// spool:		spool of the email message
 // sender:		sender of the email
 // rcpts:		recipients of the email
 // response:	response written to client
-void handle_rset(int comm_fd, int* state, string& content, char* sender, vector < string >&rcpts, 
+void handle_rset(string& out, int* state, Spool* spool, char* sender, vector < string >&rcpts, 
 	char* response) {
 
 	if (*state == 0) {
-		write(comm_fd, BAD_SEQUENCE, strlen(BAD_SEQUENCE));
-		strcpy(response, BAD_SEQUENCE);
+		queue_response(out, response, BAD_SEQUENCE);
 	} else {
-		content.clear();
+		spool_discard(spool);
 		sender[0] = '\0';
 		rcpts.clear();
 
-		write(comm_fd, OK, strlen(OK));
-		strcpy(response, OK);
+		queue_response(out, response, OK);
 
 		*state = 1;
 	}
 }
 
 // Handler for QUIT command. Sets quit flag to true.
-// comm_fd: 	client's socket
+// out: 		client's output buffer
 // state: 		current transaction state
 // quit:		true if the client writes QUIT
 // response:	response written to client
-void handle_quit(int comm_fd, int* state, bool* quit, char* response) {
+void handle_quit(string& out, int* state, bool* quit, char* response) {
 	*state = 6;
 	*quit = true;
 
-	write(comm_fd, SERVICE_CLOSING, strlen(SERVICE_CLOSING));
-	strcpy(response, SERVICE_CLOSING);
+	queue_response(out, response, SERVICE_CLOSING);
 }
 
 // Parse an email address from src and copy it to dest.
@@ -489,6 +1291,7 @@ void copy_mailbox(char* dest, char* src) {
 		j++;
 	}
 	dest[j] = src[i];
+	dest[j + 1] = '\0';
 }
 
 // Parse recipient's email and host name from src and copy to rcpt and host.
@@ -508,6 +1311,7 @@ void copy_rcpt_host(char* rcpt, char* host, char* src) {
 		i++;
 		j++;
 	}
+	rcpt[j] = '\0';
 	i++;
 
 	j = 0;
@@ -519,22 +1323,184 @@ void copy_rcpt_host(char* rcpt, char* host, char* src) {
 	host[j] = '\0';
 }
 
-// After worker thread has parsed a full command, this function clears the command from buffer, and moves
-// all remaining characters to the start of buffer.
-void remove_command(char* buf, char* end) {
-	char* curr = buf;
+// Creates a spool file for a new message.
+// spool:	spool of the email message
+bool spool_open(Spool* spool) {
+	spool_discard(spool);
+	snprintf(spool->path, PATH_LEN, "%s/.spool/msg.XXXXXX", PARENTDIR);
+	spool->fd = mkstemp(spool->path);
+	spool->failed = spool->fd < 0;
+	return !spool->failed;
+}
 
-	while (curr != end) {
-		*curr = '\0';
-		curr++;
+// Appends one line of the message, writing to the spool file whenever SPOOL_CHUNK bytes are buffered.
+// spool:	spool of the email message
+// data:	line to append
+// len:		length of the line
+void spool_append(Spool* spool, const char* data, int len) {
+	spool->pending.append(data, len);
+	if (spool->pending.length() >= SPOOL_CHUNK) {
+		spool_flush(spool);
 	}
+}
 
-	curr = buf;
+// Writes buffered lines to the spool file. A failed write marks the spool so the message is rejected.
+// spool:	spool of the email message
+bool spool_flush(Spool* spool) {
+	const char* data = spool->pending.data();
+	size_t left = spool->pending.length();
 
-	while (*end != '\0') {
-		*curr = *end;
-		*end = '\0';
-		curr++;
-		end++;
+	while (left > 0 && !spool->failed) {
+		ssize_t wlen = write(spool->fd, data, left);
+		if (wlen < 0 && errno == EINTR) {
+			continue;
+		}
+		if (wlen <= 0) {
+			spool->failed = true;
+			break;
+		}
+		data += wlen;
+		left -= wlen;
+	}
+	spool->pending.clear();
+	return !spool->failed;
+}
+
+// Removes the spool file and resets the spool.
+// spool:	spool of the email message
+void spool_discard(Spool* spool) {
+	if (spool->fd >= 0) {
+		close(spool->fd);
+		unlink(spool->path);
+	}
+	spool->fd = -1;
+	spool->path[0] = '\0';
+	spool->pending.clear();
+	spool->failed = false;
+}
+
+// Delivers a finished message. Unless durability is off, the message is first recorded in the journal, and
+// this returns only once the record and the body are on disk, so a message that got its 250 reply survives a
+// crash. Returns false if the message could not be made durable or delivered.
+// spool:	spool of the email message
+// sender:	sender of the email
+// rcpts:	recipients of the email
+bool store_message(Spool* spool, char* sender, vector< string >& rcpts) {
+	if (DURABILITY == DURABLE_NONE) {
+		return deliver_spool(spool, sender, rcpts);
+	}
+	if (!spool_flush(spool)) {
+		return false;
+	}
+
+	Delivery* delivery = JOURNAL.begin(spool->fd, spool->path, sender, rcpts);
+	if (delivery == NULL) {
+		return false;
+	}
+	bool delivered = JOURNAL.commit(delivery) && deliver_spool(spool, sender, rcpts);
+
+	// the journal removes the spool file once the mailboxes are synced
+	spool->fd = -1;
+	spool->path[0] = '\0';
+	JOURNAL.finish(delivery);
+	return delivered;
+}
+
+// Appends the spooled message to every recipient's mailbox. A message for a single recipient is copied into
+// the mailbox by the kernel. With several recipients the body is written once: the spool file is hard linked
+// into PARENTDIR/.store as <id>.<mailbox> for each recipient, and each mailbox only gets a reference line.
+// The body is freed when the last recipient deletes it.
+// spool:	spool of the email message
+// sender:	sender of the email
+// rcpts:	recipients of the email
+bool deliver_spool(Spool* spool, char* sender, vector< string >& rcpts) {
+	if (!spool_flush(spool)) {
+		return false;
+	}
+
+	struct stat st;
+	fstat(spool->fd, &st);
+
+	time_t now = time(0);
+	char date[32];
+	ctime_r(&now, date);
+	string timestamp = "From ";
+	timestamp = timestamp + sender + " " + date;
+
+	// the inode number is unique for as long as any link to the body exists
+	char id[64] = "";
+	if (rcpts.size() >= STORE_MIN_RCPTS) {
+		snprintf(id, sizeof(id), "%lx.%lx", (long)now, (long)st.st_ino);
+	}
+
+	// the index record is the same for every recipient, except for where the message lands in the mailbox
+	IndexRecord record;
+	memset(&record, 0, sizeof(record));
+	record.size = st.st_size;
+	index_content(spool->fd, 0, st.st_size, UID_SCHEME, record);
+	int content_flags = record.flags;
+
+	bool delivered = true;
+	for (int i = 0; i < rcpts.size(); i++) {
+		string path = string(PARENTDIR) + "/" + rcpts[i];
+		string link_path = string(PARENTDIR) + "/.store/" + id + "." + rcpts[i];
+		bool linked = strlen(id) > 0 && link(spool->path, link_path.c_str()) == 0;
+
+		bool ok;
+		if (linked) {
+			string header = timestamp + STORE_REF + id + "\r\n";
+			record.flags = content_flags | INDEX_STORED;
+			ok = append_message(path, header, -1, 0, record);
+			if (!ok) {
+				unlink(link_path.c_str());
+			}
+		} else {
+			record.flags = content_flags;
+			ok = append_message(path, timestamp, spool->fd, st.st_size, record);
+		}
+		delivered = delivered && ok;
+	}
+
+	return delivered;
+}
+
+// Appends one message to a mailbox and its record to the mailbox's index. Appends are serialized with a lock
+// because sendfile() cannot write to O_APPEND files. A failed append is truncated so no partial message is left
+// behind.
+// path:		path of the mailbox
+// header:		"From " line, and anything else to write before the body
+// body_fd:		file to copy the body from, or -1 for no body
+// body_len:	length of the body
+// record:		index record of the message, completed with its place in the mailbox
+bool append_message(string& path, string& header, int body_fd, off_t body_len, IndexRecord& record) {
+	int mbox = mailbox_lock(path, O_WRONLY | O_CREAT, LOCK_EX);
+	if (mbox < 0) {
+		return false;
+	}
+
+	off_t start = lseek(mbox, 0, SEEK_END);
+	bool ok = write(mbox, header.data(), header.length()) == header.length();
+
+	off_t offset = 0;
+	while (ok && body_fd >= 0 && offset < body_len) {
+		ssize_t slen = sendfile(mbox, body_fd, &offset, body_len - offset);
+		if (slen <= 0) {
+			ok = false;
+		}
+	}
+
+	if (!ok) {
+		ftruncate(mbox, start);
+	} else {
+		int index_fd = open((path + INDEX_SUFFIX).c_str(), O_RDWR | O_CREAT, 0600);
+		if (index_fd >= 0) {
+			record.offset = start;
+			record.length = header.length() + (body_fd >= 0 ? body_len : 0);
+			index_append(index_fd, record, UID_SCHEME);
+			close(index_fd);
+		}
 	}
+	flock(mbox, LOCK_UN);
+	close(mbox);
+	return ok;
 }
@@ -0,0 +1,197 @@
+#ifndef UIDHASH_H
+#define UIDHASH_H
+
+#include <openssl/evp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Schemes for the unique ids of messages. A unique id is a digest of the message's content, printed as 32 hex
+// digits, so it stays the same across restarts as long as the scheme does. The scheme of a mailbox is recorded
+// in its index; changing it changes every unique id, which clients see as new mail.
+//
+// UID_MD5 is the original scheme. UID_FAST is a 128-bit hash in the style of XXH64: four 64-bit lanes consume
+// 32 bytes per step with a multiply and a rotate each, and are folded into two differently mixed halves.
+
+// unique id schemes
+const int UID_MD5 	= 0;
+const int UID_FAST 	= 1;
+
+// constant integers
+const int UID_DIGITS 	= 32;
+const int FAST_STRIPE 	= 32;
+
+// constant 64-bit primes of XXH64
+const uint64_t FAST_PRIME1 	= 0x9E3779B185EBCA87ULL;
+const uint64_t FAST_PRIME2 	= 0xC2B2AE3D27D4EB4FULL;
+const uint64_t FAST_PRIME3 	= 0x165667B19E3779F9ULL;
+const uint64_t FAST_PRIME4 	= 0x85EBCA77C2B2AE63ULL;
+const uint64_t FAST_PRIME5 	= 0x27D4EB2F165667C5ULL;
+
+// Digest of a message's content, fed in pieces.
+class UidHash {
+public:
+	virtual ~UidHash() {}
+
+	// Adds the next piece of the content.
+	// data:	piece of the content
+	// len:		length of the piece
+	virtual void update(const char* data, size_t len) = 0;
+
+	// Writes the unique id, UID_DIGITS hex digits and a '\0'.
+	// uid:		buffer of at least UID_DIGITS + 1 bytes
+	virtual void final(char* uid) = 0;
+};
+
+// UID_MD5: hex MD5 digest, through OpenSSL's EVP interface.
+class Md5UidHash : public UidHash {
+public:
+	Md5UidHash(): context(EVP_MD_CTX_new()) {
+		EVP_DigestInit_ex(context, md5(), NULL);
+	}
+
+	~Md5UidHash() {
+		EVP_MD_CTX_free(context);
+	}
+
+	void update(const char* data, size_t len) {
+		EVP_DigestUpdate(context, data, len);
+	}
+
+	void final(char* uid) {
+		unsigned char digest[EVP_MAX_MD_SIZE];
+		unsigned int digest_len = 0;
+		EVP_DigestFinal_ex(context, digest, &digest_len);
+		for (int i = 0; i < digest_len && 2 * i < UID_DIGITS; i++) {
+			snprintf(uid + 2 * i, 3, "%02x", digest[i]);
+		}
+	}
+
+private:
+	Md5UidHash(const Md5UidHash&);
+	Md5UidHash& operator=(const Md5UidHash&);
+
+	// OpenSSL 3 looks EVP_md5() up again on every init unless it is fetched once
+	static const EVP_MD* md5() {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		static EVP_MD* md = EVP_MD_fetch(NULL, "MD5", NULL);
+		return md;
+#else
+		return EVP_md5();
+#endif
+	}
+
+	EVP_MD_CTX* context;
+};
+
+// UID_FAST: 128-bit non-cryptographic hash.
+class FastUidHash : public UidHash {
+public:
+	FastUidHash(): total(0), buffered(0) {
+		lanes[0] = FAST_PRIME1 + FAST_PRIME2;
+		lanes[1] = FAST_PRIME2;
+		lanes[2] = 0;
+		lanes[3] = 0 - FAST_PRIME1;
+	}
+
+	void update(const char* data, size_t len) {
+		total += len;
+		if (buffered > 0) {
+			size_t fill = len < FAST_STRIPE - buffered ? len : FAST_STRIPE - buffered;
+			memcpy(buffer + buffered, data, fill);
+			buffered += fill;
+			data += fill;
+			len -= fill;
+			if (buffered < FAST_STRIPE) {
+				return;
+			}
+			stripe(buffer);
+			buffered = 0;
+		}
+		while (len >= FAST_STRIPE) {
+			stripe(data);
+			data += FAST_STRIPE;
+			len -= FAST_STRIPE;
+		}
+		memcpy(buffer, data, len);
+		buffered = len;
+	}
+
+	void final(char* uid) {
+		uint64_t low = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18);
+		uint64_t high = (rotl(lanes[0], 18) + rotl(lanes[1], 12) + rotl(lanes[2], 7) + rotl(lanes[3], 1))
+			^ FAST_PRIME4;
+		low += total;
+		high += total * FAST_PRIME5;
+
+		// the bytes left over from the last stripe, 8 and then 1 at a time
+		const char* p = buffer;
+		const char* end = buffer + buffered;
+		for (; end - p >= 8; p += 8) {
+			uint64_t word;
+			memcpy(&word, p, 8);
+			low = rotl(low ^ round(0, word), 27) * FAST_PRIME1 + FAST_PRIME4;
+			high = rotl(high ^ round(FAST_PRIME5, word), 31) * FAST_PRIME2 + FAST_PRIME3;
+		}
+		for (; p < end; p++) {
+			low = rotl(low ^ ((unsigned char)*p * FAST_PRIME5), 11) * FAST_PRIME1;
+			high = rotl(high ^ ((unsigned char)*p * FAST_PRIME1), 13) * FAST_PRIME5;
+		}
+
+		snprintf(uid, UID_DIGITS + 1, "%016llx%016llx", (unsigned long long)avalanche(high),
+			(unsigned long long)avalanche(low));
+	}
+
+private:
+	static uint64_t rotl(uint64_t x, int bits) {
+		return (x << bits) | (x >> (64 - bits));
+	}
+
+	static uint64_t round(uint64_t lane, uint64_t word) {
+		return rotl(lane + word * FAST_PRIME2, 31) * FAST_PRIME1;
+	}
+
+	static uint64_t avalanche(uint64_t h) {
+		h ^= h >> 33;
+		h *= FAST_PRIME2;
+		h ^= h >> 29;
+		h *= FAST_PRIME3;
+		return h ^ (h >> 32);
+	}
+
+	void stripe(const char* data) {
+		uint64_t words[4];
+		memcpy(words, data, sizeof(words));
+		lanes[0] = round(lanes[0], words[0]);
+		lanes[1] = round(lanes[1], words[1]);
+		lanes[2] = round(lanes[2], words[2]);
+		lanes[3] = round(lanes[3], words[3]);
+	}
+
+	uint64_t lanes[4];
+	uint64_t total;
+	char buffer[FAST_STRIPE];
+	size_t buffered;
+};
+
+// Returns a new digest in the given scheme, which the caller deletes.
+// scheme:	unique id scheme
+inline UidHash* new_uid_hash(int scheme) {
+	if (scheme == UID_FAST) {
+		return new FastUidHash();
+	}
+	return new Md5UidHash();
+}
+
+// Returns the scheme named on the command line ("md5" or "fast"), or -1.
+// name:	name of the scheme
+inline int uid_scheme(const char* name) {
+	if (strcmp(name, "md5") == 0) {
+		return UID_MD5;
+	} else if (strcmp(name, "fast") == 0) {
+		return UID_FAST;
+	}
+	return -1;
+}
+
+#endif